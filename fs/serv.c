@@ -45,8 +45,12 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests: the request page, then the data of a big write.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - IPC_MAXPAGES * PGSIZE);
+
+// Virtual address at which to put the data of big reads, to send it back.
+char *fsreadbuf = (char *)(DISKMAP - 2 * IPC_MAXPAGES * PGSIZE);
 
 void
 serve_init(void)
@@ -204,12 +208,15 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
 // the number of bytes successfully read, or < 0 on error.
+// If req_n > PGSIZE, the bytes go back in fresh pages instead, which we
+// set *pg_store and *perm_store to send.
 int
-serve_read(envid_t envid, union Fsipc *ipc)
+serve_read(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
 {
 	struct Fsreq_read *req = &ipc->read;
 	struct Fsret_read *ret = &ipc->readRet;
 	struct OpenFile *o;
+	size_t n;
 	int r;
 
 	if (debug)
@@ -219,12 +226,27 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if ((r = file_read(o->o_file, ret->ret_buf, MIN(req->req_n, PGSIZE),
-			   o->o_fd->fd_offset)) < 0)
+	if (req->req_n <= PGSIZE) {
+		if ((r = file_read(o->o_file, ret->ret_buf, req->req_n,
+				   o->o_fd->fd_offset)) < 0)
+			return r;
+		o->o_fd->fd_offset += r;
 		return r;
+	}
 
+	// The client keeps the pages we send, so don't reuse the last ones.
+	n = MIN(req->req_n, FSIPC_MAXDATA);
+	if ((r = sys_page_alloc_range(0, fsreadbuf, ROUNDUP(n, PGSIZE) / PGSIZE,
+				      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	if ((r = file_read(o->o_file, fsreadbuf, n, o->o_fd->fd_offset)) < 0)
+		return r;
 	o->o_fd->fd_offset += r;
 
+	if (r > 0) {
+		*pg_store = IPC_PAGES(fsreadbuf, ROUNDUP(r, PGSIZE) / PGSIZE);
+		*perm_store = PTE_P | PTE_U | PTE_W;
+	}
 	return r;
 }
 
@@ -233,10 +255,14 @@ serve_read(envid_t envid, union Fsipc *ipc)
 // the current seek position, and update the seek position
 // accordingly.  Extend the file if necessary.  Returns the number of
 // bytes written, or < 0 on error.
+// If req_n > sizeof(req->req_buf), the bytes are in the pages that were
+// sent after the request page instead; we write as many as were sent.
 int
 serve_write(envid_t envid, struct Fsreq_write *req)
 {
 	struct OpenFile *o;
+	const void *buf = req->req_buf;
+	size_t n = req->req_n;
 	int r;
 
 	if (debug)
@@ -246,8 +272,12 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if ((r = file_write(o->o_file, req->req_buf, req->req_n,
-			    o->o_fd->fd_offset)) < 0)
+	if (n > sizeof(req->req_buf)) {
+		buf = (char *) req + PGSIZE;
+		n = MIN(n, (thisenv->env_ipc_npages - 1) * PGSIZE);
+	}
+
+	if ((r = file_write(o->o_file, buf, n, o->o_fd->fd_offset)) < 0)
 		return r;
 
 	o->o_fd->fd_offset += r;
@@ -306,9 +336,9 @@ serve_sync(envid_t envid, union Fsipc *req)
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and read are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
-	[FSREQ_READ] =		serve_read,
+	/* [FSREQ_READ] =	serve_read, */
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
@@ -320,12 +350,13 @@ void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, npages, r;
 	void *pg;
 
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, IPC_PAGES(fsreq, IPC_MAXPAGES),
+		       &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -334,12 +365,19 @@ serve(void)
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			perm = 0;
+			req = ipc_recv((int32_t *) &whom,
+				       IPC_PAGES(fsreq, IPC_MAXPAGES), &perm);
+			continue;
 		}
 
+		npages = thisenv->env_ipc_npages;
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ) {
+			r = serve_read(whom, fsreq, &pg, &perm);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
@@ -347,9 +385,13 @@ serve(void)
 			r = -E_INVAL;
 		}
 
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		// The reply is all in the client's page already, or in pg.
+		sys_page_unmap_range(0, fsreq, npages);
 		log_commit();
+
+		// Reply and wait for the next request in one go.
+		req = ipc_reply_wait(r, pg, perm, (int32_t *) &whom,
+				     IPC_PAGES(fsreq, IPC_MAXPAGES), &perm);
 	}
 }
 
@@ -11,11 +11,11 @@ typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+---------------18--------------+----------13---------+
+// |0|          Uniqueifier          |     Environment     |
+// | |                               |        Index        |
+// +---------------------------------+---------------------+
+//                                    \---- ENVX(eid) ----/
 //
 // The environment index ENVX(eid) equals the environment's offset in the
 // 'envs[]' array.  The uniqueifier distinguishes environments that were
@@ -24,11 +24,18 @@ typedef int32_t envid_t;
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
+//
+// envs[] has room for NENV environments, but only the part of it that has
+// been used so far is mapped: it grows a page at a time as environments
+// are created.
 
-#define LOG2NENV		10
+#define LOG2NENV		13
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Number of scheduling priority levels; 0 is the highest.
+#define ENV_NPRIO		4
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -44,6 +51,30 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 };
 
+// Maximum number of messages sent with sys_ipc_send_async that may be
+// waiting for an env to receive them.
+#define IPC_QUEUE_LEN		32
+
+// An IPC message carries up to IPC_MAXPAGES contiguous pages.  The IPC
+// system calls take page-aligned addresses, whose low bits may hold a page
+// count: IPC_PAGES(va, n) names the n pages from va, on the sending side
+// the pages to send, on the receiving side the window to map them in.  A
+// plain page-aligned va stands for one page.  If the sender sends more
+// pages than the receiver's window holds, only those that fit are mapped.
+#define IPC_MAXPAGES		16
+#define IPC_PAGES(va, n)	((void *) ((uintptr_t) (va) | ((n) - 1)))
+
+// A message received with sys_ipc_recv_batch.
+struct IpcMsg {
+	envid_t im_from;		// envid of the sender
+	uint32_t im_value;		// Data value sent
+	int im_perm;			// Perm of the page mapping received
+};
+
+struct RunQueue;
+struct CpuInfo;
+struct FpuState;
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -54,18 +85,48 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct RunQueue *env_rq;	// Run queue we're on (NULL if none)
+	struct Env *env_rq_next;	// Next env on env_rq
+	struct Env *env_rq_prev;	// Previous env on env_rq
+	struct CpuInfo *env_cpu;	// CPU still using us (NULL if none)
+	int env_priority;		// Current priority level
+	int env_base_priority;		// Level we get boosted back to
+	int env_slice;			// Timer ticks left at env_priority
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	bool env_merge;			// Idle CPUs may merge duplicate pages
+
+	// FPU and SSE state (see kern/fpu.c)
+	struct FpuState *env_fpu;	// Saved state, NULL if never used
+	struct CpuInfo *env_fpu_cpu;	// CPU whose FPU last held it, if any
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
-	void *env_ipc_dstva;		// VA at which to map received page
+	void *env_ipc_dstva;		// VA at which to map received pages
+	int env_ipc_dstnpages;		// Number of pages that fit there
+	int env_ipc_npages;		// Number of pages received
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recv_from;	// Only receive from this env (0: any)
+	envid_t env_ipc_caller;		// Env to reply to (0 if none)
+	struct IpcMsg *env_ipc_batch;	// Where to store the message, if
+					// blocked in sys_ipc_recv_batch
+
+	// Blocking IPC send
+	bool env_ipc_sending;		// Env is blocked sending
+	envid_t env_ipc_send_to;	// Env whose wait list we're on, if any
+	uint32_t env_ipc_send_value;	// Value we're sending
+	struct PageInfo *env_ipc_send_pages[IPC_MAXPAGES]; // Pages we're sending
+	int env_ipc_send_npages;	// Number of pages we're sending
+	int env_ipc_send_perm;		// Perm of the pages we're sending
+	struct Env *env_ipc_send_next;	// Next env on the same wait list
+	struct Env *env_ipc_senders;	// Envs blocked sending to us
 };
 
 #endif // !JOS_INC_ENV_H
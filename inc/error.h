@@ -15,6 +15,7 @@ enum {
 	E_FAULT		,	// Memory fault
 
 	E_IPC_NOT_RECV	,	// Attempt to send to env that is not recving
+	E_IPC_QUEUE_FULL,	// Env's queue of IPC messages is full
 	E_EOF		,	// Unexpected end of file
 
 	// File system error codes -- only seen in user-level
@@ -5,6 +5,7 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
 
 // File nodes (both in-memory and on-disk)
 
@@ -92,12 +93,13 @@ union Fsipc {
 		size_t req_n;
 	} read;
 	struct Fsret_read {
-		char ret_buf[PGSIZE];
+		char ret_buf[PGSIZE];	// Unless req_n > PGSIZE
 	} readRet;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
 		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
+					// Unless req_n > sizeof(req_buf)
 	} write;
 	struct Fsreq_stat {
 		int req_fileid;
@@ -118,4 +120,9 @@ union Fsipc {
 	char _pad[PGSIZE];
 };
 
+// Reads and writes too big for the request page move their data in up to
+// FSIPC_MAXDATA bytes of extra pages: a read gets them back as the reply's
+// pages, and a write sends them right after the request page.
+#define FSIPC_MAXDATA	((IPC_MAXPAGES - 1) * PGSIZE)
+
 #endif /* !JOS_INC_FS_H */
@@ -16,6 +16,7 @@
 #include <inc/env.h>
 #include <inc/memlayout.h>
 #include <inc/syscall.h>
+#include <inc/sysinfo.h>
 #include <inc/trap.h>
 #include <inc/fs.h>
 #include <inc/fd.h>
@@ -31,6 +32,16 @@ extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct SysInfo sysinfo;
+
+// Is envs[envx] mapped?  envs[] is only mapped as far as the kernel has
+// grown it, a page at a time.
+static inline bool
+envx_mapped(int envx)
+{
+	return envx >= 0 && envx < NENV &&
+		(uvpt[PGNUM((uintptr_t) (envs + envx + 1) - 1)] & PTE_P);
+}
 
 // exit.c
 void	exit(void);
@@ -48,17 +59,44 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_priority(envid_t env, int priority);
+int	sys_env_set_mergeable(envid_t env, int on);
+int	sys_submit(struct SyscallRing *ring, int flags);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t npages, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va, envid_t dst_env,
+			   void *dst_va, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t npages);
+int	sys_page_protect_range(envid_t env, void *va, size_t npages, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_send_async(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_recv_batch(struct IpcMsg *msgs, int n, void *rcv_pg);
 int     sys_get_cpu(void);
 
+// sysinfo.c
+uint64_t	sys_time_ns(void);
+int	getcpu(void);
+
+// sysring.c
+extern struct SyscallRing sysring;
+int	sysring_queue(struct SyscallRing *ring, uint32_t num, uint32_t a1,
+		      uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+int	sysring_submit(struct SyscallRing *ring, int flags);
+
+extern bool syscall_sysenter;
+
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
 sys_exofork(void)
@@ -73,12 +111,16 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+void	ipc_send_async(envid_t to_env, uint32_t value, void *pg, int perm);
+int	ipc_recv_batch(struct IpcMsg *msgs, int n, void *pg);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-int duppage(envid_t envid, unsigned pn);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
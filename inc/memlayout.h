@@ -43,12 +43,16 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |   Kernel's envs[] (grows up) | RW/--             |
+ *  MMIOLIM, KENVS ->  +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |          RO PAGES            | R-/R-  PTSIZE
+ *                     |        RO SYSTEM INFO        | R-/R-  PGSIZE
+ *    UINFO     ---->  +------------------------------+ 0xef3ff000
+ *                     |          RO PAGES            | R-/R-  PTSIZE-PGSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
@@ -102,6 +106,11 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// The kernel's writable view of the envs[] array, which is mapped on
+// demand, at the bottom of the kernel stack area, well below all the
+// CPUs' stacks.  The same pages are mapped read-only at UENVS.
+#define KENVS		MMIOLIM
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -113,6 +122,8 @@
 #define UVPT		(ULIM - PTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
+// The system information page (see inc/sysinfo.h), above the pages
+#define UINFO		(UVPT - PGSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
 
@@ -177,16 +188,26 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous blocks on the free list, for the first page of
+	// a free block.
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
 	// Pages allocated at boot time using pmap.c's
 	// boot_alloc do not have valid reference count fields.
 
-	uint16_t pp_ref;
+	uint32_t pp_ref;
+
+	// If this is the first page of a free block, the block's order (it
+	// is 2^pp_order pages long); PP_ORDER_CACHED if it's a free page in a
+	// CPU's page cache; otherwise PP_ORDER_NONE.
+	int8_t pp_order;
 };
 
+#define PP_ORDER_NONE	(-1)
+#define PP_ORDER_CACHED	(-2)
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
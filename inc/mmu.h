@@ -66,9 +66,12 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user processes
+// are allowed to set them arbitrarily.  sys_fork and the kernel's page
+// fault handler give two of them a meaning.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_SHARE	0x400	// Shared with children, not copied on fork
+#define PTE_COW		0x800	// Copy-on-write
 
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
@@ -90,7 +93,10 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// SIMD FP exceptions as #XM
+#define CR4_OSFXSR	0x00000200	// FXSAVE/FXRSTOR and SSE enable
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
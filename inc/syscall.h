@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -18,7 +20,42 @@ enum {
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
 	SYS_get_cpu,
+	SYS_env_set_priority,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_send_async,
+	SYS_ipc_recv_batch,
+	SYS_fork,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_page_protect_range,
+	SYS_env_set_mergeable,
+	SYS_submit,
 	NSYSCALLS
 };
 
+// A system call queued for sys_submit: the number and arguments are as
+// for the other system calls, and the kernel stores the return value.
+struct SyscallDesc {
+	uint32_t sd_num;
+	uint32_t sd_args[5];
+	int32_t sd_ret;
+};
+
+// A page of system calls for sys_submit.  The user queues calls at
+// sr_tail and the kernel runs them from sr_head; both count up forever,
+// and entry i is in sr_ents[i % SYSRING_NENTS].
+#define SYSRING_NENTS	128
+
+struct SyscallRing {
+	volatile uint32_t sr_head;	// Calls the kernel has run
+	volatile uint32_t sr_tail;	// Calls the user has queued
+	struct SyscallDesc sr_ents[SYSRING_NENTS];
+};
+
+// sys_submit flags
+#define SUBMIT_STOP	0x1		// Stop after the first call that fails
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -0,0 +1,51 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_SYSINFO_H
+#define JOS_INC_SYSINFO_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+// Most CPUs the system information page has room for.
+#define SYSINFO_NCPU	8
+
+// Nanoseconds are (TSC ticks * si_ns_mult) >> SYSINFO_NS_SHIFT.
+#define SYSINFO_NS_SHIFT	24
+
+// What one CPU is up to.  A CPU only gets timer ticks while it has envs
+// waiting, so sc_ticks stands still while it runs a single env or idles.
+struct SysCpuInfo {
+	volatile envid_t sc_env;	// Env running on this CPU, 0 if idle
+	volatile uint32_t sc_ticks;	// Timer ticks this CPU has seen
+	volatile uint32_t sc_switches;	// Switches to a different env
+	volatile uint32_t sc_load;	// Envs on this CPU's run queue, now
+} __attribute__((aligned(64)));
+
+// The system information page, which the kernel keeps up to date and
+// maps read-only at UINFO in every environment, so that user programs
+// can read the clock and the like without a system call.  Nothing in it
+// is a consistent snapshot, except for the fields fixed at boot.
+struct SysInfo {
+	// Fixed at boot.
+	uint64_t si_tsc_hz;		// TSC ticks per second, 0 if unknown
+	uint64_t si_tsc_boot;		// The TSC when the clock started
+	uint32_t si_ns_mult;		// See SYSINFO_NS_SHIFT
+	uint32_t si_ncpu;
+
+	volatile uint32_t si_free_pages;	// At most about 1ms old
+
+	struct SysCpuInfo si_cpus[SYSINFO_NCPU];
+};
+
+// Convert a TSC reading to nanoseconds since the clock started.
+static inline uint64_t
+sysinfo_tsc2ns(const volatile struct SysInfo *si, uint64_t tsc)
+{
+	uint64_t delta = tsc - si->si_tsc_boot;
+
+	// A 64x32 bit product, in two halves so as not to overflow.
+	return (((delta & 0xffffffff) * si->si_ns_mult) >> SYSINFO_NS_SHIFT) +
+		(((delta >> 32) * si->si_ns_mult) << (32 - SYSINFO_NS_SHIFT));
+}
+
+#endif	// !JOS_INC_SYSINFO_H
@@ -185,6 +185,24 @@ rcr4(void)
 	return cr4;
 }
 
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static inline void
+fxsave(void *area)
+{
+	asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+}
+
+static inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+}
+
 static inline void
 tlbflush(void)
 {
@@ -240,6 +258,17 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// Model-specific registers for sysenter
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -261,4 +290,15 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'inc' to *addr, returning the old value of *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return inc;
+}
+
 #endif /* !JOS_INC_X86_H */
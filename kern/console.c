@@ -9,6 +9,7 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -438,6 +439,12 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// Protects cons and the input devices: any CPU may poll them through
+// cons_getc(), while the boot CPU also takes their interrupts.
+static struct spinlock cons_lock = {
+	.name = "cons_lock"
+};
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
@@ -445,6 +452,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			// kbd received one of two scan codes to form a letter,
@@ -454,6 +462,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -469,13 +478,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
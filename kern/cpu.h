@@ -22,6 +22,10 @@ struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	volatile int cpu_load;          // Number of envs on our run queue
+	uint32_t cpu_tlb_gen;           // tlb_gen when we last loaded cr3
+	struct Env *cpu_fpu_owner;      // Env whose state the FPU holds
+	bool cpu_fpu_live;              // ... and is running with TS clear
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
 };
 
@@ -30,6 +34,12 @@ extern struct CpuInfo cpus[NCPU];
 extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+extern uint32_t lapic_timer_hz;     // LAPIC timer counts per second
+extern unsigned lapic_timer_us;     // Length of a timer tick
+
+// Timer tick length, in microseconds: the default, and the shortest.
+#define TIMER_QUANTUM_US	10000
+#define TIMER_QUANTUM_MIN_US	100
 
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
@@ -41,6 +51,10 @@ void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+int lapic_timer_set_quantum(unsigned us);
+void lapic_timer_start(void);
+void lapic_timer_stop(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
 
 #endif
@@ -14,12 +14,39 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/ipc.h>
+#include <kern/kmem.h>
+#include <kern/sysinfo.h>
+#include <kern/fpu.h>
 
-struct Env *envs = NULL;		// All environments
+struct Env *envs = (struct Env *) KENVS;	// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
-#define ENVGENSHIFT	12		// >= LOGNENV
+// envs[] grows on demand, a page at a time; the first env_nslots entries
+// are mapped.  env_grow_lock serializes growing it.
+size_t env_nslots;
+static struct spinlock env_grow_lock = {
+	.name = "env_grow_lock"
+};
+
+// Locking.  env_free_lock protects env_free_list.  *env_locks[ENVX(id)]
+// protects everything else about an env: its status, run queue
+// membership, page tables, trapframe (while it isn't running) and IPC
+// state.  Locks are taken in this order:
+//	env_grow_lock
+//	env locks (two at most, see env_lock_pair)
+//	run queue locks (kern/sched.c), ipc_wait_lock (kern/ipc.c)
+//	kmem cache locks (kern/kmem.c)
+//	page_lock (kern/pmap.c)
+//	env_free_lock, console locks
+static struct spinlock env_free_lock = {
+	.name = "env_free_lock"
+};
+static struct spinlock *env_locks[NENV];
+static struct KmemCache *env_lock_cache;
+
+#define ENVGENSHIFT	13		// >= LOG2NENV
 
 // Global descriptor table.
 //
@@ -88,6 +115,11 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	// envs[] is only mapped as far as it has grown.
+	if (ENVX(envid) >= env_nslots) {
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
 	if (e->env_status == ENV_FREE || e->env_id != envid) {
 		*env_store = 0;
@@ -108,29 +140,188 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
-// Mark all environments in 'envs' as free, set their env_ids to 0,
-// and insert them into the env_free_list.
-// Make sure the environments are in the free list in the same order
-// they are in the envs array (i.e., so that the first call to
-// env_alloc() returns envs[0]).
+// Is 'e' still the env that 'envid' named when we looked it up?
+// It may have been freed, and its slot reused, before we locked it.
+static bool
+env_still_valid(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE && (envid == 0 || e->env_id == envid);
+}
+
 //
+// Like envid2env, but returns with the environment locked.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0) {
+		*env_store = NULL;
+		return r;
+	}
+
+	env_lock(e);
+	if (!env_still_valid(e, envid)) {
+		env_unlock(e);
+		*env_store = NULL;
+		return -E_BAD_ENV;
+	}
+
+	*env_store = e;
+	return 0;
+}
+
+//
+// Like envid2env, but for two environments at once, which are returned
+// locked.  They may be the same environment.
+//
+int
+envid2env_lock_pair(envid_t envid1, struct Env **env1_store,
+		    envid_t envid2, struct Env **env2_store, bool checkperm)
+{
+	struct Env *e1, *e2;
+	int r;
+
+	*env1_store = *env2_store = NULL;
+	if ((r = envid2env(envid1, &e1, checkperm)) < 0 ||
+	    (r = envid2env(envid2, &e2, checkperm)) < 0)
+		return r;
+
+	env_lock_pair(e1, e2);
+	if (!env_still_valid(e1, envid1) || !env_still_valid(e2, envid2)) {
+		env_unlock_pair(e1, e2);
+		return -E_BAD_ENV;
+	}
+
+	*env1_store = e1;
+	*env2_store = e2;
+	return 0;
+}
+
 void
-env_init(void)
+env_lock(struct Env *e)
+{
+	spin_lock(env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(env_locks[e - envs]);
+}
+
+// Lock two envs, which may be the same one.  Envs are always locked in
+// the order they appear in envs[], so two CPUs locking the same pair
+// can't deadlock.
+void
+env_lock_pair(struct Env *e1, struct Env *e2)
+{
+	if (e1 == e2) {
+		env_lock(e1);
+		return;
+	}
+	if (e1 > e2) {
+		struct Env *tmp = e1;
+		e1 = e2;
+		e2 = tmp;
+	}
+	env_lock(e1);
+	env_lock(e2);
+}
+
+void
+env_unlock_pair(struct Env *e1, struct Env *e2)
+{
+	env_unlock(e1);
+	if (e2 != e1)
+		env_unlock(e2);
+}
+
+// Map another page of envs[], at KENVS and UENVS, and put the
+// environments that now fit in it on the env_free_list, in the order they
+// are in the envs array.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if envs[] already holds NENV environments
+//	-E_NO_MEM on memory exhaustion
+//
+static int
+env_grow(void)
 {
+	struct PageInfo *pp;
 	struct Env *envp;
-	struct Env *envlast;
+	size_t mapped, first, last;
+
+	spin_lock(&env_grow_lock);
+	mapped = ROUNDUP(env_nslots * sizeof(struct Env), PGSIZE);
+	first = env_nslots;
+	last = MIN((mapped + PGSIZE) / sizeof(struct Env), NENV);
+	if (first == NENV) {
+		spin_unlock(&env_grow_lock);
+		return -E_NO_FREE_ENV;
+	}
 
-	// Set up envs array
-	// LAB 3: Your code here.
-	env_free_list = envs;
-	for (envp = envs, envlast = envs + NENV - 1; envp <= envlast; envp++)
-	{
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		goto nomem;
+	for (envp = envs + first; envp < envs + last; envp++) {
+		if ((env_locks[envp - envs] =
+		     kmem_cache_alloc(env_lock_cache)) == NULL) {
+			while (--envp >= envs + first)
+				kmem_cache_free(env_lock_cache,
+						env_locks[envp - envs]);
+			page_free(pp);
+			goto nomem;
+		}
+		__spin_initlock(env_locks[envp - envs], "env_lock");
+	}
+
+	// The page tables are there already (see mem_init), so this can't
+	// fail, and every address space sees the new page right away.
+	if (page_insert(kern_pgdir, pp, (void *) (KENVS + mapped),
+			PTE_W | PTE_G) < 0 ||
+	    page_insert(kern_pgdir, pp, (void *) (UENVS + mapped), PTE_U) < 0)
+		panic("env_grow: no envs page table");
+
+	// The first new Env may start in the page mapped before.
+	for (envp = envs + first; envp < envs + last; envp++)
 		*envp = (struct Env){
 			.env_status = ENV_FREE,
-			.env_link = (envp == envlast) ? NULL : envp + 1,
+			.env_link = (envp == envs + last - 1) ? NULL : envp + 1,
 			.env_id = 0,
 		};
-	}
+	env_nslots = last;
+
+	spin_lock(&env_free_lock);
+	envs[last - 1].env_link = env_free_list;
+	env_free_list = &envs[first];
+	spin_unlock(&env_free_lock);
+
+	spin_unlock(&env_grow_lock);
+	return 0;
+
+nomem:
+	spin_unlock(&env_grow_lock);
+	return -E_NO_MEM;
+}
+
+// Set up the envs array with its first page of environments, which
+// env_grow puts on the env_free_list in the order they are in the envs
+// array (i.e., so that the first call to env_alloc() returns envs[0]).
+//
+void
+env_init(void)
+{
+	int r;
+
+	// Set up envs array
+	// LAB 3: Your code here.
+	env_lock_cache = kmem_cache_create("env_lock", sizeof(struct spinlock),
+					   0, NULL);
+	if (env_lock_cache == NULL || (r = env_grow()) < 0)
+		panic("env_init: can't set up envs: %e",
+		      env_lock_cache ? r : -E_NO_MEM);
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -222,12 +413,24 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
-		return -E_NO_FREE_ENV;
+	spin_lock(&env_free_lock);
+	while (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
+		if ((r = env_grow()) < 0)
+			return r;
+		spin_lock(&env_free_lock);
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -238,7 +441,6 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -248,6 +450,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Ensure interrupts are enabled
 	memset(&e->env_tf, 0, sizeof(e->env_tf));
 	e->env_tf.tf_eflags = FL_IF;
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = NULL;
 
 	// Set up appropriate initial values for the segment registers.
 	// GD_UD is the user data segment selector in the GDT, and
@@ -270,12 +474,25 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag, and the blocking send state.
 	e->env_ipc_recving = 0;
-
-	// commit the allocation
-	env_free_list = e->env_link;
+	e->env_ipc_caller = 0;
+	e->env_ipc_batch = NULL;
+	e->env_ipc_sending = false;
+	e->env_ipc_send_to = 0;
+	e->env_ipc_send_npages = 0;
+	e->env_ipc_senders = NULL;
+
+	// Commit the allocation.  The new env stays ENV_NOT_RUNNABLE until
+	// its creator has finished setting it up.
 	e->env_link = NULL;
+	e->env_cpu = NULL;
+	e->env_base_priority = 0;
+	e->env_merge = false;
+	env_lock(e);
+	sched_set_priority(e, 0);
+	e->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(e);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -474,18 +691,19 @@ env_create(uint8_t *binary, enum EnvType type)
 	env->env_type = type;
 	if (type == ENV_TYPE_FS)
 		env->env_tf.tf_eflags |= FL_IOPL_3;
+
+	env_lock(env);
+	sched_enqueue(env);
+	env_unlock(env);
 }
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold e's lock, and e must not be running on another CPU.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
-
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
@@ -495,57 +713,46 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-	}
-
-	// free the page directory
-	pa = PADDR(e->env_pgdir);
+	// Free the address space, page tables, pages and all.  Nothing runs
+	// in it anymore, so this can wait for an idle CPU.
+	pgdir_release(e->env_pgdir);
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
+
+	// Nobody can send to us anymore, and we're done sending.
+	ipc_env_free(e);
+	fpu_free(e);
 
 	// return the environment to the free list
+	sched_dequeue(e);
 	e->env_status = ENV_FREE;
+	e->env_cpu = NULL;
+	spin_lock(&env_free_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_free_lock);
 }
 
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
+// The caller must hold e's lock; env_destroy releases it.
 //
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	// If e is currently running on another CPU, we change its state to
+	// ENV_DYING. A zombie environment will be freed by that CPU the next
+	// time it traps to the kernel, or when it lets go of it.
+	if (e->env_cpu != NULL && e->env_cpu != thiscpu) {
 		e->env_status = ENV_DYING;
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
+	ipc_wake_orphans();
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -565,13 +772,8 @@ env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
+	thissysinfo->sc_env = curenv->env_id;
 
-	// Unlocking here is safe because all we're doing is modifying our
-	// cpu-specific stack, so no race conditions are possible.
-	// It'd be safe to unlock it in env_run() ATM but then we run the risk
-	// of modifiying this function to have a side effect outside cpu-private
-	// state AFTER the lock has been released.
-	unlock_kernel();
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
@@ -583,15 +785,39 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// This CPU is done with 'e', which was its curenv: it no longer runs it
+// and has switched to another page directory.  From here on, other CPUs
+// may run e.  Put e back on a run queue if it was merely preempted, or
+// free it if it was killed while we were running it.
+//
+void
+env_release(struct Env *e)
+{
+	fpu_release(e);
+	env_lock(e);
+	assert(e->env_cpu == thiscpu);
+	e->env_cpu = NULL;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	else if (e->env_status == ENV_RUNNING)
+		sched_enqueue(e);
+	env_unlock(e);
+	ipc_wake_orphans();
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// e must be curenv, or have been claimed for this CPU by the scheduler.
 //
 // This function does not return.
 //
 void
 env_run(struct Env *e)
 {
+	struct Env *prev = curenv;
+
 	// Step 1: If this is a context switch (a new environment is running):
 	//	   1. Set the current environment (if any) back to
 	//	      ENV_RUNNABLE if it is ENV_RUNNING (think about
@@ -610,14 +836,21 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
+	assert(e->env_cpu == thiscpu);
 
+	if (prev != e)
+		thissysinfo->sc_switches++;
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
 	curenv->env_runs++;
 
-	lcr3(PADDR(e->env_pgdir));
+	// Going back to the env we came from keeps its TLB entries.
+	pgdir_load(e->env_pgdir);
+
+	// Only now that we're off its page tables may another CPU have prev.
+	if (prev != NULL && prev != e)
+		env_release(prev);
+	if (prev != e)
+		fpu_switch(e);
 
 	env_pop_tf(&e->env_tf);
 }
@@ -7,6 +7,7 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern size_t env_nslots;		// Entries of envs[] set up so far
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -16,8 +17,18 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_release(struct Env *e);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock_pair(envid_t envid1, struct Env **env1_store,
+			    envid_t envid2, struct Env **env2_store,
+			    bool checkperm);
+
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *e1, struct Env *e2);
+void	env_unlock_pair(struct Env *e1, struct Env *e2);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -0,0 +1,160 @@
+// Lazy FPU and SSE context switching.
+//
+// An env gets somewhere to save its x87 and SSE registers the first time
+// it uses them.  CR0.TS is set whenever the FPU doesn't hold the state of
+// the env we run, so that its first FPU instruction traps with #NM
+// (T_DEVICE), and fpu_trap loads its state then.  Envs that never touch
+// the FPU never pay for it.
+//
+// Each CPU remembers whose state its FPU holds (cpu_fpu_owner), and each
+// env which CPU last loaded its state (env_fpu_cpu).  The registers are
+// saved when a CPU lets go of their owner, since it may run on another
+// CPU next, but stay loaded: if the owner comes back to the same CPU
+// before anyone else used the FPU there, TS is simply cleared.  The
+// kernel itself is built not to use the FPU or SSE.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/cpuid.h>
+#include <kern/kmem.h>
+#include <kern/fpu.h>
+
+static struct KmemCache *fpu_cache;
+
+// The state an env starts with, as after FNINIT with all the registers
+// cleared, and all SSE exceptions masked.
+static const struct FpuState fpu_initstate = {
+	.fs_fcw = 0x037f,
+	.fs_mxcsr = 0x1f80,
+};
+
+void
+fpu_init(void)
+{
+	static_assert(sizeof(struct FpuState) == 512);
+
+	fpu_cache = kmem_cache_create("env_fpu", sizeof(struct FpuState),
+				      __alignof__(struct FpuState), NULL);
+	if (fpu_cache == NULL)
+		panic("fpu_init: cannot create cache");
+}
+
+//
+// Set this CPU up to trap the first FPU instruction of each env.  Without
+// FXSAVE, every FPU instruction traps, and kills the env that tried it.
+//
+void
+fpu_init_percpu(void)
+{
+	uint32_t cr0 = rcr0();
+
+	cr0 |= CR0_MP | CR0_NE | CR0_TS;
+	if (cpu_hasedxfeat(CPUID_FEAT_EDX_FXSR)) {
+		cr0 &= ~CR0_EM;
+		if (cpu_hasedxfeat(CPUID_FEAT_EDX_SSE))
+			lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	} else
+		cr0 |= CR0_EM;
+	lcr0(cr0);
+
+	thiscpu->cpu_fpu_owner = NULL;
+	thiscpu->cpu_fpu_live = false;
+}
+
+//
+// Handle #NM from curenv: give it the FPU, with its own state.
+// Returns -E_NO_MEM if we can't allocate it somewhere to save its state,
+// and -E_INVAL if this CPU can't save FPU state at all.
+//
+int
+fpu_trap(void)
+{
+	struct Env *e = curenv;
+
+	if (rcr0() & CR0_EM)
+		return -E_INVAL;
+
+	if (e->env_fpu == NULL) {
+		if ((e->env_fpu = kmem_cache_alloc(fpu_cache)) == NULL)
+			return -E_NO_MEM;
+		*e->env_fpu = fpu_initstate;
+	}
+
+	clts();
+	if (thiscpu->cpu_fpu_owner != e || e->env_fpu_cpu != thiscpu)
+		fxrstor(e->env_fpu);
+	thiscpu->cpu_fpu_owner = e;
+	thiscpu->cpu_fpu_live = true;
+	e->env_fpu_cpu = thiscpu;
+	return 0;
+}
+
+//
+// We are about to run e, which is not the env we ran last.  Let it use
+// the FPU right away if the FPU still holds its state.
+//
+void
+fpu_switch(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_owner == e && e->env_fpu_cpu == thiscpu) {
+		clts();
+		thiscpu->cpu_fpu_live = true;
+	}
+}
+
+//
+// This CPU is letting go of e.  Save its FPU state if it used the FPU
+// since we last saved it, and trap the next FPU instruction.
+//
+void
+fpu_release(struct Env *e)
+{
+	if (!thiscpu->cpu_fpu_live)
+		return;
+	assert(thiscpu->cpu_fpu_owner == e);
+	fxsave(e->env_fpu);
+	lcr0(rcr0() | CR0_TS);
+	thiscpu->cpu_fpu_live = false;
+}
+
+//
+// Give the new env 'child' a copy of the FPU state of 'parent', which is
+// curenv.  Returns -E_NO_MEM if out of memory.
+//
+int
+fpu_fork(struct Env *child, struct Env *parent)
+{
+	if (parent->env_fpu == NULL)
+		return 0;
+	if ((child->env_fpu = kmem_cache_alloc(fpu_cache)) == NULL)
+		return -E_NO_MEM;
+	if (thiscpu->cpu_fpu_live)
+		fxsave(parent->env_fpu);
+	*child->env_fpu = *parent->env_fpu;
+	return 0;
+}
+
+//
+// Free e's FPU state.  e is being freed, and no CPU but ours may be
+// running it.
+//
+void
+fpu_free(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_owner == e) {
+		if (thiscpu->cpu_fpu_live) {
+			lcr0(rcr0() | CR0_TS);
+			thiscpu->cpu_fpu_live = false;
+		}
+		thiscpu->cpu_fpu_owner = NULL;
+	}
+	if (e->env_fpu != NULL)
+		kmem_cache_free(fpu_cache, e->env_fpu);
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = NULL;
+}
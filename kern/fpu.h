@@ -0,0 +1,37 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// The x87 and SSE registers, as FXSAVE stores them.
+struct FpuState {
+	uint16_t fs_fcw;		// x87 control word
+	uint16_t fs_fsw;		// x87 status word
+	uint8_t fs_ftw;			// x87 tag word, abridged
+	uint8_t fs_reserved;
+	uint16_t fs_fop;
+	uint32_t fs_fip;
+	uint32_t fs_fcs;
+	uint32_t fs_fdp;
+	uint32_t fs_fds;
+	uint32_t fs_mxcsr;		// SSE control and status
+	uint32_t fs_mxcsr_mask;
+	uint8_t fs_regs[480];		// ST0-7, XMM0-7, and reserved space
+} __attribute__((aligned(16)));
+
+void	fpu_init(void);
+void	fpu_init_percpu(void);
+int	fpu_trap(void);
+void	fpu_switch(struct Env *e);
+void	fpu_release(struct Env *e);
+int	fpu_fork(struct Env *child, struct Env *parent);
+void	fpu_free(struct Env *e);
+
+#endif	// !JOS_KERN_FPU_H
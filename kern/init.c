@@ -7,9 +7,12 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
 #include <kern/kclock.h>
+#include <kern/sysinfo.h>
 #include <kern/env.h>
 #include <kern/trap.h>
+#include <kern/fpu.h>
 
 #include <kern/sched.h>
 #include <kern/picirq.h>
@@ -39,10 +42,13 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	fpu_init();
+	sched_init();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -51,12 +57,8 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
+	// The system information page, and its clock
+	sysinfo_init();
 
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
@@ -72,6 +74,11 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Starting non-boot CPUs.  There's no big kernel lock to hold them
+	// back, so they go looking for work as soon as they're up; the
+	// initial environments are already queued.
+	boot_aps();
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -102,8 +109,9 @@ boot_aps(void)
 		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
 		// Start the CPU at mpentry_start
 		lapic_startap(c->cpu_id, PADDR(code));
-		// Wait for the CPU to finish some basic setup in mp_main()
-		while(c->cpu_status != CPU_STARTED)
+		// Wait for the CPU to finish some basic setup in mp_main().
+		// It may already have gone on to halt by the time we look.
+		while(c->cpu_status == CPU_UNUSED)
 			;
 	}
 }
@@ -113,6 +121,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
+	mem_init_percpu();
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -122,11 +131,7 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.
 	sched_yield();
 }
 
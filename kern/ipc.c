@@ -0,0 +1,448 @@
+// Blocking IPC: wait lists of envs blocked sending to a receiver.
+//
+// An env that sends to a receiver that isn't waiting for a message
+// queues itself on the receiver's env_ipc_senders list and blocks.  When
+// the receiver calls sys_ipc_recv, it takes the first sender off its list
+// and the message goes through right away.  The sender holds a reference
+// to the pages it sends, so it's the pages that were mapped at the time of
+// the send that the receiver gets.
+//
+// Whoever takes a sender off a list finishes its send with
+// ipc_send_done().  Senders left on the list of a receiver that dies are
+// moved to ipc_orphans, and woken up with -E_BAD_ENV once the dying
+// receiver's lock has been released (env locks have to be taken in
+// order, so we can't lock the senders there and then).
+//
+// Messages sent with sys_ipc_send_async don't block their sender.  If the
+// receiver isn't waiting for one, they go on its bounded queue, which it
+// drains before taking the blocked senders.  sys_ipc_recv_batch takes
+// several queued messages at once.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/ipc.h>
+
+// Protects the wait lists, ipc_orphans, and env_ipc_send_to,
+// env_ipc_send_next and env_ipc_send_pages of the envs on them.
+// Nests inside env locks.
+static struct spinlock ipc_wait_lock = {
+	.name = "ipc_wait_lock"
+};
+static struct Env *ipc_orphans;
+
+// env_ipc_send_to of the envs on ipc_orphans
+#define IPC_ORPHANED	((envid_t) -1)
+
+// An env's queue of messages sent with sys_ipc_send_async, a ring of
+// IPC_QUEUE_LEN.  Allocated a page the first time the env is sent such a
+// message, and protected by the env's lock.
+struct IpcQueue {
+	unsigned iq_head;	// Index of the oldest message
+	unsigned iq_count;	// Number of messages queued
+	struct {
+		envid_t from;
+		uint32_t value;
+		struct IpcPages pages;	// We hold a reference to each
+	} iq_msgs[IPC_QUEUE_LEN];
+};
+static struct IpcQueue *ipc_queues[NENV];
+
+// Drop the references we hold to the pages of p.
+static void
+ipc_pages_decref(struct IpcPages *p)
+{
+	int i;
+
+	for (i = 0; i < p->npages; i++)
+		page_decref(p->pages[i]);
+	p->npages = 0;
+}
+
+// Decode 'range', an address passed to an IPC system call, which may be
+// IPC_PAGES(va, n), into the page-aligned va and the number of pages.
+// Addresses at or above UTOP stand for no pages at all.
+// Returns 0 on success, -E_INVAL if the count is out of range or the pages
+// don't fit below UTOP.
+int
+ipc_range(void *range, void **va_store, int *npages_store)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) range, PGSIZE);
+	int npages = PGOFF(range) + 1;
+
+	*va_store = (void *) va;
+	*npages_store = 0;
+	if (va >= UTOP)
+		return 0;
+	if (npages > IPC_MAXPAGES || va + npages * PGSIZE > UTOP)
+		return -E_INVAL;
+	*npages_store = npages;
+	return 0;
+}
+
+// Look up the 'npages' pages at 'va' in e's address space, which the
+// caller has locked, to send them with 'perm'.  We don't take references
+// to them.
+// Returns 0 on success, -E_INVAL if perm is inappropriate, or one of the
+// pages isn't mapped or is in a superpage, or (perm & PTE_W) but the
+// page is read-only.
+int
+ipc_lookup_pages(struct Env *e, void *va, int npages, int perm,
+		 struct IpcPages *p)
+{
+	pte_t *pte;
+	int i;
+
+	p->npages = 0;
+	p->perm = 0;
+	if (npages == 0)
+		return 0;
+	if ((perm & ~PTE_SYSCALL) || !((perm & PTE_U) || (perm & PTE_P)))
+		return -E_INVAL;
+
+	for (i = 0; i < npages; i++, va += PGSIZE) {
+		if ((p->pages[i] = page_lookup(e->env_pgdir, va, &pte)) == NULL ||
+		    (*pte & PTE_PS) || ((perm & PTE_W) && !(*pte & PTE_W)))
+			return -E_INVAL;
+	}
+	p->npages = npages;
+	p->perm = perm;
+	return 0;
+}
+
+// Map as many of the pages of p as fit in the 'maxpages' from 'dstva' in
+// recv's address space.  If that fails partway, we unmap the pages we
+// already mapped.
+// Returns the number of pages mapped, or -E_NO_MEM.
+static int
+ipc_map_pages(struct Env *recv, void *dstva, int maxpages, struct IpcPages *p)
+{
+	int i, n = MIN(p->npages, maxpages);
+
+	for (i = 0; i < n; i++) {
+		if (page_insert(recv->env_pgdir, p->pages[i],
+				dstva + i * PGSIZE, p->perm) != 0) {
+			while (--i >= 0)
+				page_remove(recv->env_pgdir,
+					    dstva + i * PGSIZE);
+			return -E_NO_MEM;
+		}
+	}
+	return n;
+}
+
+// Is recv waiting for a message that send may give it?  The caller holds
+// recv's lock.  An env in sys_ipc_call only takes the reply, and only once
+// its request has gone through.
+bool
+ipc_recving_from(struct Env *recv, struct Env *send)
+{
+	return recv->env_ipc_recving && !recv->env_ipc_sending &&
+	       recv->env_status != ENV_DYING &&
+	       (recv->env_ipc_recv_from == 0 ||
+		recv->env_ipc_recv_from == send->env_id);
+}
+
+// Copy 'len' bytes from 'src' to 'va' in e's address space, which must be
+// mapped user-writable.  e need not be curenv.  The caller holds e's lock.
+static int
+ipc_copyout(struct Env *e, void *va, const void *src, size_t len)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t n;
+
+	while (len > 0) {
+		if ((uintptr_t)va >= UTOP ||
+		    (pp = page_lookup(e->env_pgdir, va, &pte)) == NULL ||
+		    (*pte & (PTE_U | PTE_W)) != (PTE_U | PTE_W))
+			return -E_FAULT;
+		n = MIN(len, PGSIZE - PGOFF(va));
+		memcpy((char *) page2kva(pp) + PGOFF(va), src, n);
+		va += n;
+		src += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Store a message as the i'th of the batch 'msgs' that recv, which the
+// caller has locked, asked for with sys_ipc_recv_batch.  Its first page,
+// if any, is mapped at the i'th page from recv's env_ipc_dstva.
+int
+ipc_deliver_batch(struct Env *recv, struct IpcMsg *msgs, int i, envid_t from,
+		  uint32_t value, struct IpcPages *p, bool call)
+{
+	struct IpcMsg msg;
+	int r;
+
+	msg.im_from = from;
+	msg.im_value = value;
+	msg.im_perm = 0;
+	if (recv->env_ipc_dstnpages > 0) {
+		if ((r = ipc_map_pages(recv, recv->env_ipc_dstva + i * PGSIZE,
+				       1, p)) < 0)
+			return r;
+		if (r > 0)
+			msg.im_perm = p->perm;
+	}
+	if (ipc_copyout(recv, &msgs[i], &msg, sizeof(msg)) < 0)
+		return -E_FAULT;
+
+	recv->env_ipc_caller = call ? from : 0;
+	return 0;
+}
+
+// Give 'value', and the pages of p that fit in the window recv asked for,
+// to recv, which the caller has locked and which is waiting for a
+// message.  If 'call', the sender waits for recv's reply.  This also sets
+// what recv's receiving system call returns, for when recv wakes up.
+// Returns 0 on success, -E_NO_MEM if the pages couldn't be mapped.
+int
+ipc_deliver(struct Env *recv, envid_t from, uint32_t value,
+	    struct IpcPages *p, bool call)
+{
+	int r;
+
+	if (recv->env_ipc_batch != NULL) {
+		if ((r = ipc_deliver_batch(recv, recv->env_ipc_batch, 0, from,
+					   value, p, call)) < 0)
+			return r;
+		recv->env_ipc_batch = NULL;
+		recv->env_ipc_recving = false;
+		recv->env_tf.tf_regs.reg_eax = 1;
+		return 0;
+	}
+
+	if ((r = ipc_map_pages(recv, recv->env_ipc_dstva,
+			       recv->env_ipc_dstnpages, p)) < 0)
+		return r;
+	recv->env_ipc_npages = r;
+	recv->env_ipc_perm = r > 0 ? p->perm : 0;
+
+	recv->env_ipc_recving = false;
+	recv->env_ipc_value = value;
+	recv->env_ipc_from = from;
+	recv->env_ipc_caller = call ? from : 0;
+	recv->env_tf.tf_regs.reg_eax = 0;
+	return 0;
+}
+
+// Queue a message for recv, which the caller has locked.  We take
+// references to the pages of p.
+// Returns 0 on success, -E_IPC_QUEUE_FULL if recv already has
+// IPC_QUEUE_LEN messages waiting, or -E_NO_MEM.
+int
+ipc_queue_put(struct Env *recv, envid_t from, uint32_t value,
+	      struct IpcPages *p)
+{
+	struct IpcQueue *q = ipc_queues[ENVX(recv->env_id)];
+	struct PageInfo *pp;
+	unsigned i;
+	int j;
+
+	static_assert(sizeof(struct IpcQueue) <= PGSIZE);
+	if (q == NULL) {
+		if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+		q = ipc_queues[ENVX(recv->env_id)] = page2kva(pp);
+	}
+	if (q->iq_count == IPC_QUEUE_LEN)
+		return -E_IPC_QUEUE_FULL;
+
+	i = (q->iq_head + q->iq_count++) % IPC_QUEUE_LEN;
+	q->iq_msgs[i].from = from;
+	q->iq_msgs[i].value = value;
+	q->iq_msgs[i].pages = *p;
+	for (j = 0; j < p->npages; j++)
+		page_incref(p->pages[j]);
+	return 0;
+}
+
+// Take the oldest message off recv's queue, if any, into s, with no
+// sender to wake up.  The caller holds recv's lock, and must pass s to
+// ipc_send_done() when done.
+bool
+ipc_queue_get(struct Env *recv, struct IpcSender *s)
+{
+	struct IpcQueue *q = ipc_queues[ENVX(recv->env_id)];
+
+	if (q == NULL || q->iq_count == 0)
+		return false;
+
+	s->env = NULL;
+	s->envid = q->iq_msgs[q->iq_head].from;
+	s->value = q->iq_msgs[q->iq_head].value;
+	s->pages = q->iq_msgs[q->iq_head].pages;
+	s->call = false;
+	q->iq_head = (q->iq_head + 1) % IPC_QUEUE_LEN;
+	q->iq_count--;
+	return true;
+}
+
+// Block send, which is sending 'value' and the pages of p, until recv
+// asks for a message: put it at the end of recv's wait list.  We take
+// references to the pages.  The caller holds both envs' locks, and makes
+// send not runnable.
+void
+ipc_wait_block(struct Env *recv, struct Env *send, uint32_t value,
+	       struct IpcPages *p)
+{
+	struct Env **pp;
+	int i;
+
+	for (i = 0; i < p->npages; i++) {
+		page_incref(p->pages[i]);
+		send->env_ipc_send_pages[i] = p->pages[i];
+	}
+	send->env_ipc_send_npages = p->npages;
+	send->env_ipc_send_perm = p->perm;
+	send->env_ipc_send_value = value;
+	send->env_ipc_sending = true;
+
+	spin_lock(&ipc_wait_lock);
+	assert(send->env_ipc_send_to == 0);
+	for (pp = &recv->env_ipc_senders; *pp; pp = &(*pp)->env_ipc_send_next)
+		/* do nothing */;
+	*pp = send;
+	send->env_ipc_send_next = NULL;
+	send->env_ipc_send_to = recv->env_id;
+	spin_unlock(&ipc_wait_lock);
+}
+
+// Take the first env off *list into s.  Caller holds ipc_wait_lock.
+static bool
+ipc_wait_pop(struct Env **list, struct IpcSender *s)
+{
+	struct Env *e;
+
+	if ((e = *list) == NULL)
+		return false;
+	*list = e->env_ipc_send_next;
+	e->env_ipc_send_next = NULL;
+	e->env_ipc_send_to = 0;
+
+	s->env = e;
+	s->envid = e->env_id;
+	s->value = e->env_ipc_send_value;
+	memmove(s->pages.pages, e->env_ipc_send_pages,
+		e->env_ipc_send_npages * sizeof(e->env_ipc_send_pages[0]));
+	s->pages.npages = e->env_ipc_send_npages;
+	s->pages.perm = e->env_ipc_send_perm;
+	// Only e itself changes this, and not while it's on a list.
+	s->call = e->env_ipc_recving;
+	e->env_ipc_send_npages = 0;
+	return true;
+}
+
+// Take the first sender off recv's wait list, if any.  The caller holds
+// recv's lock, and must pass s to ipc_send_done() once it has released it.
+bool
+ipc_wait_dequeue(struct Env *recv, struct IpcSender *s)
+{
+	bool found;
+
+	spin_lock(&ipc_wait_lock);
+	found = ipc_wait_pop(&recv->env_ipc_senders, s);
+	spin_unlock(&ipc_wait_lock);
+	return found;
+}
+
+// Finish the send of s, which was taken off a wait list: its
+// sys_ipc_send returns r.  A successful sys_ipc_call stays blocked, now
+// waiting for the reply.  For a message from a queue, there is nobody to
+// tell, so a message that couldn't be delivered is lost.  Called with no
+// env locks held.
+void
+ipc_send_done(struct IpcSender *s, int r)
+{
+	struct Env *e = s->env;
+
+	ipc_pages_decref(&s->pages);
+	if (e == NULL)
+		return;
+
+	// The sender may have been freed since it was taken off the list.
+	env_lock(e);
+	if (e->env_status != ENV_FREE && e->env_id == s->envid &&
+	    e->env_ipc_sending) {
+		e->env_ipc_sending = false;
+		if (r != 0 || !e->env_ipc_recving) {
+			e->env_ipc_recving = false;
+			e->env_tf.tf_regs.reg_eax = r;
+			if (e->env_status == ENV_NOT_RUNNABLE)
+				sched_enqueue(e);
+		}
+	}
+	env_unlock(e);
+}
+
+// e, which the caller has locked, is being freed.  Take it off the wait
+// list it's on, orphan the envs waiting to send to it, and drop the
+// messages queued for it.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env **pp, *s;
+	struct IpcQueue *q = ipc_queues[ENVX(e->env_id)];
+	struct IpcSender msg;
+	int i;
+
+	if (q != NULL) {
+		while (ipc_queue_get(e, &msg))
+			ipc_pages_decref(&msg.pages);
+		ipc_queues[ENVX(e->env_id)] = NULL;
+		page_free(pa2page(PADDR(q)));
+	}
+	e->env_ipc_batch = NULL;
+
+	spin_lock(&ipc_wait_lock);
+	if (e->env_ipc_send_to != 0) {
+		if (e->env_ipc_send_to == IPC_ORPHANED)
+			pp = &ipc_orphans;
+		else
+			pp = &envs[ENVX(e->env_ipc_send_to)].env_ipc_senders;
+		for (; *pp != e; pp = &(*pp)->env_ipc_send_next)
+			assert(*pp != NULL);
+		*pp = e->env_ipc_send_next;
+		e->env_ipc_send_next = NULL;
+		e->env_ipc_send_to = 0;
+		for (i = 0; i < e->env_ipc_send_npages; i++)
+			page_decref(e->env_ipc_send_pages[i]);
+		e->env_ipc_send_npages = 0;
+	}
+	e->env_ipc_sending = false;
+
+	while ((s = e->env_ipc_senders) != NULL) {
+		e->env_ipc_senders = s->env_ipc_send_next;
+		s->env_ipc_send_next = ipc_orphans;
+		s->env_ipc_send_to = IPC_ORPHANED;
+		ipc_orphans = s;
+	}
+	spin_unlock(&ipc_wait_lock);
+}
+
+// Fail the sends of the envs whose receiver died.  Called with no env
+// locks held, after freeing an env.
+void
+ipc_wake_orphans(void)
+{
+	struct IpcSender s;
+	bool found;
+
+	// Unlocked peek: the env that orphaned them calls us after it's
+	// done, so we can't miss any.
+	while (ipc_orphans != NULL) {
+		spin_lock(&ipc_wait_lock);
+		found = ipc_wait_pop(&ipc_orphans, &s);
+		spin_unlock(&ipc_wait_lock);
+		if (!found)
+			break;
+		ipc_send_done(&s, -E_BAD_ENV);
+	}
+}
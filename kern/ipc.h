@@ -0,0 +1,51 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+// The pages of a message, in order.
+struct IpcPages {
+	struct PageInfo *pages[IPC_MAXPAGES];
+	int npages;
+	int perm;
+};
+
+// A message taken off a wait list or a queue; we hold a reference to each
+// of its pages.
+struct IpcSender {
+	struct Env *env;	// Env blocked sending it, or NULL
+	envid_t envid;
+	uint32_t value;
+	struct IpcPages pages;
+	bool call;		// Sent with sys_ipc_call
+};
+
+int ipc_range(void *range, void **va_store, int *npages_store);
+int ipc_lookup_pages(struct Env *e, void *va, int npages, int perm,
+		     struct IpcPages *p);
+
+bool ipc_recving_from(struct Env *recv, struct Env *send);
+int ipc_deliver(struct Env *recv, envid_t from, uint32_t value,
+		struct IpcPages *p, bool call);
+int ipc_deliver_batch(struct Env *recv, struct IpcMsg *msgs, int i,
+		      envid_t from, uint32_t value, struct IpcPages *p,
+		      bool call);
+
+void ipc_wait_block(struct Env *recv, struct Env *send, uint32_t value,
+		    struct IpcPages *p);
+int ipc_queue_put(struct Env *recv, envid_t from, uint32_t value,
+		  struct IpcPages *p);
+bool ipc_queue_get(struct Env *recv, struct IpcSender *s);
+
+bool ipc_wait_dequeue(struct Env *recv, struct IpcSender *s);
+void ipc_send_done(struct IpcSender *s, int r);
+
+void ipc_env_free(struct Env *e);
+void ipc_wake_orphans(void);
+
+#endif	// !JOS_KERN_IPC_H
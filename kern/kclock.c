@@ -1,6 +1,7 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for
+ * timing the TSC against the 8253 timer. */
 
 #include <inc/x86.h>
 
@@ -20,3 +21,50 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// How long we wait for the 8253, in port reads, before giving up.
+#define CALIBRATE_SPINS	100000000
+
+static uint8_t calibrate_portb;
+
+// Start counter 2 of the 8253 timer counting down CALIBRATE_COUNT ticks.
+// It isn't used for anything else.
+void
+calibrate_start(void)
+{
+	// Gate counter 2 on, with the speaker off, and count down once.
+	calibrate_portb = inb(IO_PORTB);
+	outb(IO_PORTB, (calibrate_portb & ~0x02) | 0x01);
+	outb(IO_TIMER_CTL, 0xB0);	// Counter 2, LSB then MSB, mode 0
+	outb(IO_TIMER2, CALIBRATE_COUNT & 0xff);
+	outb(IO_TIMER2, CALIBRATE_COUNT >> 8);
+}
+
+// Wait for the count started by calibrate_start to run out.  Returns
+// false if it never does.
+bool
+calibrate_wait(void)
+{
+	int i;
+
+	// The counter's output goes high when the count runs out.
+	for (i = 0; i < CALIBRATE_SPINS && !(inb(IO_PORTB) & 0x20); i++)
+		;
+	outb(IO_PORTB, calibrate_portb);
+	return i < CALIBRATE_SPINS;
+}
+
+// Measure the TSC frequency, in Hz.  Returns 0 if the 8253 timer never
+// fires.
+uint64_t
+tsc_calibrate(void)
+{
+	uint64_t start, end;
+
+	calibrate_start();
+	start = read_tsc();
+	if (!calibrate_wait())
+		return 0;
+	end = read_tsc();
+	return CALIBRATE_HZ(end - start);
+}
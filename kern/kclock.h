@@ -6,8 +6,15 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
+#define	IO_TIMER2	0x042		/* 8253 timer, counter 2 */
+#define	IO_TIMER_CTL	0x043		/* 8253 timer, control word */
+#define	IO_PORTB	0x061		/* Timer 2 gate and output, speaker */
+#define	TIMER_FREQ	1193182		/* 8253 input clock, in Hz */
+
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50	/* 50 bytes of NVRAM */
 
@@ -26,4 +33,13 @@
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
+// Clocks are calibrated by counting their ticks while the 8253 timer
+// counts down CALIBRATE_COUNT of its own, about 10ms.
+#define CALIBRATE_COUNT	(TIMER_FREQ / 100)
+#define CALIBRATE_HZ(ticks)	((uint64_t) (ticks) * TIMER_FREQ / CALIBRATE_COUNT)
+
+void calibrate_start(void);
+bool calibrate_wait(void);
+uint64_t tsc_calibrate(void);
+
 #endif	// !JOS_KERN_KCLOCK_H
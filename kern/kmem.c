@@ -0,0 +1,393 @@
+// Slab allocator for kernel objects.
+//
+// Each kmem cache hands out objects of one size, carved from slabs of
+// contiguous pages from page_alloc_order.  A slab starts with a struct
+// KmemSlab, followed by a stack of its free objects, followed by the
+// objects themselves.  Slabs are aligned to their size, so the slab of an
+// object is found by rounding its address down.
+//
+// A cache's constructor runs once on each object, when its slab is
+// created; objects must be freed back in their constructed state.  It runs
+// with the cache's lock held, so it must not use the same cache.
+//
+// Most allocations and frees only touch the CPU's own cache of objects,
+// which needs no lock since the kernel runs with interrupts off.  Objects
+// move between it and the slabs KMEM_CPU_CACHE_BATCH at a time.  Cache
+// locks nest inside env locks, and page_lock nests inside them.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+// Slabs have at least this many objects, if their order allows.
+#define KMEM_MIN_PERSLAB	8
+#define KMEM_MAX_ORDER		3
+
+struct KmemSlab {
+	struct KmemCache *ks_cache;
+	struct KmemSlab *ks_next;	// Next slab on the same list
+	struct KmemSlab *ks_prev;	// Previous slab on the same list
+	int ks_nfree;			// Number of free objects
+	void *ks_free[];		// The free objects
+};
+
+// A slot of kmem_caches is free if its kc_name is NULL.  kmem_ncaches is
+// the number of slots that have ever been used.
+static struct KmemCache kmem_caches[KMEM_NCACHES];
+static int kmem_ncaches;
+static struct spinlock kmem_caches_lock = {
+	.name = "kmem_caches_lock"
+};
+
+static void check_kmem(void);
+
+void
+kmem_init(void)
+{
+	check_kmem();
+}
+
+// Lay out slabs of 2^order pages for kc.  Returns the number of objects
+// per slab.
+static int
+kmem_layout(struct KmemCache *kc, int order)
+{
+	size_t slabsize = PGSIZE << order;
+	int n;
+
+	n = (slabsize - sizeof(struct KmemSlab)) / (kc->kc_size + sizeof(void *));
+	for ( ; n > 0; n--) {
+		kc->kc_objoff = ROUNDUP(sizeof(struct KmemSlab) +
+					n * sizeof(void *), kc->kc_align);
+		if (kc->kc_objoff + n * kc->kc_size <= slabsize)
+			break;
+	}
+	return n;
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' (a power
+// of two, or 0 for pointer alignment).  'ctor', if not NULL, is called on
+// each object before it is first handed out.
+//
+// Returns NULL if there are too many caches, or the objects don't fit in
+// the largest slabs.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct KmemCache *kc;
+	int i, order;
+
+	if (align == 0)
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+	assert(name != NULL);
+
+	spin_lock(&kmem_caches_lock);
+	for (i = 0; i < kmem_ncaches && kmem_caches[i].kc_name; i++)
+		;
+	if (i == KMEM_NCACHES) {
+		spin_unlock(&kmem_caches_lock);
+		return NULL;
+	}
+	kc = &kmem_caches[i];
+
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_align = align;
+	kc->kc_size = ROUNDUP(MAX(size, sizeof(void *)), align);
+	kc->kc_ctor = ctor;
+	kc->kc_lock.name = (char *) name;
+	for (order = 0; order <= KMEM_MAX_ORDER; order++) {
+		kc->kc_order = order;
+		if ((kc->kc_perslab = kmem_layout(kc, order)) >=
+		    KMEM_MIN_PERSLAB)
+			break;
+	}
+	if (kc->kc_perslab == 0) {
+		kc->kc_name = NULL;
+		spin_unlock(&kmem_caches_lock);
+		return NULL;
+	}
+	if (order > KMEM_MAX_ORDER)
+		kc->kc_order = KMEM_MAX_ORDER;
+
+	if (i == kmem_ncaches)
+		kmem_ncaches++;
+	spin_unlock(&kmem_caches_lock);
+	return kc;
+}
+
+static void
+slab_push(struct KmemSlab **list, struct KmemSlab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = *list;
+	if (*list)
+		(*list)->ks_prev = s;
+	*list = s;
+}
+
+static void
+slab_unlink(struct KmemSlab **list, struct KmemSlab *s)
+{
+	if (s->ks_prev)
+		s->ks_prev->ks_next = s->ks_next;
+	else
+		*list = s->ks_next;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s->ks_prev;
+}
+
+// Make a new slab for kc, with all its objects free and constructed.
+// The caller holds kc_lock.
+static struct KmemSlab *
+slab_create(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct KmemSlab *s;
+	char *obj;
+	int i;
+
+	if ((pp = page_alloc_order(kc->kc_order, 0)) == NULL)
+		return NULL;
+	s = page2kva(pp);
+	s->ks_cache = kc;
+	s->ks_nfree = kc->kc_perslab;
+	obj = (char *) s + kc->kc_objoff;
+	for (i = 0; i < kc->kc_perslab; i++, obj += kc->kc_size) {
+		if (kc->kc_ctor)
+			kc->kc_ctor(obj);
+		// Hand out the lowest objects first
+		s->ks_free[kc->kc_perslab - 1 - i] = obj;
+	}
+	kc->kc_nslabs++;
+	return s;
+}
+
+// Move up to KMEM_CPU_CACHE_BATCH objects from kc's slabs to cc.  The
+// caller holds kc_lock.
+static void
+kmem_refill(struct KmemCache *kc, struct KmemCpuCache *cc)
+{
+	struct KmemSlab *s;
+
+	while (cc->cc_count < KMEM_CPU_CACHE_BATCH) {
+		if ((s = kc->kc_partial) != NULL) {
+			slab_unlink(&kc->kc_partial, s);
+		} else if ((s = kc->kc_empty) != NULL) {
+			slab_unlink(&kc->kc_empty, s);
+			kc->kc_nempty--;
+		} else if ((s = slab_create(kc)) == NULL) {
+			return;
+		}
+
+		while (s->ks_nfree > 0 && cc->cc_count < KMEM_CPU_CACHE_BATCH)
+			cc->cc_objs[cc->cc_count++] = s->ks_free[--s->ks_nfree];
+		slab_push(s->ks_nfree ? &kc->kc_partial : &kc->kc_full, s);
+	}
+}
+
+// Return the n oldest objects of cc to their slabs.  Empty slabs beyond
+// the first go back to the page allocator.  The caller holds kc_lock.
+static void
+kmem_drain(struct KmemCache *kc, struct KmemCpuCache *cc, int n)
+{
+	struct KmemSlab *s;
+	void *obj;
+	int i;
+
+	n = MIN(n, cc->cc_count);
+	for (i = 0; i < n; i++) {
+		obj = cc->cc_objs[i];
+		s = ROUNDDOWN(obj, PGSIZE << kc->kc_order);
+		assert(s->ks_cache == kc);
+
+		slab_unlink(s->ks_nfree ? &kc->kc_partial : &kc->kc_full, s);
+		s->ks_free[s->ks_nfree++] = obj;
+		if (s->ks_nfree < kc->kc_perslab) {
+			slab_push(&kc->kc_partial, s);
+		} else if (kc->kc_nempty == 0) {
+			slab_push(&kc->kc_empty, s);
+			kc->kc_nempty++;
+		} else {
+			kc->kc_nslabs--;
+			page_free_order(pa2page(PADDR(s)), kc->kc_order);
+		}
+	}
+	cc->cc_count -= n;
+	memmove(cc->cc_objs, cc->cc_objs + n, cc->cc_count * sizeof(void *));
+}
+
+//
+// Allocate an object from kc.
+//
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *kc)
+{
+	struct KmemCpuCache *cc = &kc->kc_cpu[cpunum()];
+
+	if (cc->cc_count == 0) {
+		spin_lock(&kc->kc_lock);
+		kmem_refill(kc, cc);
+		spin_unlock(&kc->kc_lock);
+		if (cc->cc_count == 0)
+			return NULL;
+	}
+	cc->cc_allocs++;
+	return cc->cc_objs[--cc->cc_count];
+}
+
+//
+// Return an object from kmem_cache_alloc(kc) to kc.
+//
+void
+kmem_cache_free(struct KmemCache *kc, void *obj)
+{
+	struct KmemCpuCache *cc = &kc->kc_cpu[cpunum()];
+
+	if (cc->cc_count == KMEM_CPU_CACHE_SIZE) {
+		spin_lock(&kc->kc_lock);
+		kmem_drain(kc, cc, KMEM_CPU_CACHE_BATCH);
+		spin_unlock(&kc->kc_lock);
+	}
+	cc->cc_frees++;
+	cc->cc_objs[cc->cc_count++] = obj;
+}
+
+//
+// Return the objects in this CPU's cache of kc, and kc's empty slabs, to
+// the page allocator.
+//
+void
+kmem_cache_shrink(struct KmemCache *kc)
+{
+	struct KmemCpuCache *cc = &kc->kc_cpu[cpunum()];
+	struct KmemSlab *s;
+
+	spin_lock(&kc->kc_lock);
+	kmem_drain(kc, cc, cc->cc_count);
+	while ((s = kc->kc_empty) != NULL) {
+		slab_unlink(&kc->kc_empty, s);
+		kc->kc_nempty--;
+		kc->kc_nslabs--;
+		page_free_order(pa2page(PADDR(s)), kc->kc_order);
+	}
+	spin_unlock(&kc->kc_lock);
+}
+
+//
+// Destroy kc, giving its slabs back to the page allocator.  Every object
+// must have been freed, and no CPU may use kc again.  Panics if objects
+// are still allocated.
+//
+void
+kmem_cache_destroy(struct KmemCache *kc)
+{
+	int c;
+
+	spin_lock(&kc->kc_lock);
+	for (c = 0; c < NCPU; c++)
+		kmem_drain(kc, &kc->kc_cpu[c], kc->kc_cpu[c].cc_count);
+	spin_unlock(&kc->kc_lock);
+	kmem_cache_shrink(kc);
+	if (kc->kc_nslabs != 0)
+		panic("kmem_cache_destroy: %s still has objects in use",
+		      kc->kc_name);
+
+	spin_lock(&kmem_caches_lock);
+	kc->kc_name = NULL;
+	spin_unlock(&kmem_caches_lock);
+}
+
+//
+// Fill in the usage of up to n caches in stats[].  Returns the number of
+// caches filled in.  The figures aren't a consistent snapshot.
+//
+int
+kmem_cache_stats(struct KmemStats *stats, int n)
+{
+	struct KmemCache *kc;
+	int i, j, c;
+
+	for (i = j = 0; i < n && j < kmem_ncaches; j++) {
+		kc = &kmem_caches[j];
+		if (kc->kc_name == NULL)
+			continue;
+		memset(&stats[i], 0, sizeof(stats[i]));
+		stats[i].name = kc->kc_name;
+		stats[i].size = kc->kc_size;
+		stats[i].order = kc->kc_order;
+		stats[i].nslabs = kc->kc_nslabs;
+		stats[i].total = (size_t) kc->kc_nslabs * kc->kc_perslab;
+		for (c = 0; c < NCPU; c++) {
+			stats[i].allocs += kc->kc_cpu[c].cc_allocs;
+			stats[i].frees += kc->kc_cpu[c].cc_frees;
+			stats[i].cached += kc->kc_cpu[c].cc_count;
+		}
+		stats[i].active = stats[i].allocs - stats[i].frees;
+		i++;
+	}
+	return i;
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static int check_kmem_nctor;
+
+static void
+check_kmem_ctor(void *obj)
+{
+	*(uint32_t *) obj = 0xC0FFEE;
+	check_kmem_nctor++;
+}
+
+static void
+check_kmem(void)
+{
+	struct KmemCache *kc;
+	void *objs[3 * KMEM_MIN_PERSLAB];
+	int i, j, n;
+
+	kc = kmem_cache_create("check_kmem", 200, KMEM_ALIGN_CACHE,
+			       check_kmem_ctor);
+	assert(kc && kc->kc_size == 256 && kc->kc_perslab >= KMEM_MIN_PERSLAB);
+	n = MIN(ARRAY_SIZE(objs), 2 * kc->kc_perslab + 1);
+
+	for (i = 0; i < n; i++) {
+		assert((objs[i] = kmem_cache_alloc(kc)) != NULL);
+		assert((uintptr_t) objs[i] % KMEM_ALIGN_CACHE == 0);
+		assert(*(uint32_t *) objs[i] == 0xC0FFEE);
+		for (j = 0; j < i; j++)
+			assert(objs[i] != objs[j]);
+	}
+	assert(check_kmem_nctor == kc->kc_nslabs * kc->kc_perslab);
+
+	// The last object freed comes back first, still constructed.
+	for (i = 0; i < n; i++)
+		kmem_cache_free(kc, objs[i]);
+	assert(kc->kc_cpu[cpunum()].cc_count <= KMEM_CPU_CACHE_SIZE);
+	assert(kmem_cache_alloc(kc) == objs[n - 1]);
+	assert(*(uint32_t *) objs[n - 1] == 0xC0FFEE);
+	kmem_cache_free(kc, objs[n - 1]);
+
+	// With everything free, shrinking gives all the slabs back.
+	kmem_cache_shrink(kc);
+	assert(kc->kc_nslabs == 0);
+
+	// A destroyed cache's slot is free for the next one.
+	kmem_cache_destroy(kc);
+	assert(kmem_cache_create("check_kmem", 200, 0, NULL) == kc);
+	kmem_cache_destroy(kc);
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,78 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Pass as 'align' to kmem_cache_create to give each object its own cache
+// lines.
+#define KMEM_ALIGN_CACHE	64
+
+// Objects each CPU keeps at hand, and how many move between a CPU and
+// the slabs at once.
+#define KMEM_CPU_CACHE_SIZE	16
+#define KMEM_CPU_CACHE_BATCH	8
+
+// Most caches there may be.
+#define KMEM_NCACHES		32
+
+struct KmemSlab;
+
+struct KmemCpuCache {
+	void *cc_objs[KMEM_CPU_CACHE_SIZE];
+	int cc_count;
+	uint64_t cc_allocs;		// Objects this CPU handed out
+	uint64_t cc_frees;		// Objects freed on this CPU
+} __attribute__((aligned(64)));
+
+// A cache of objects of one size.  Objects come from slabs of
+// 2^kc_order pages.  kc_lock protects the slab lists and counts; each
+// CPU's kc_cpu is only touched by that CPU, with interrupts off.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, a multiple of kc_align
+	size_t kc_align;
+	int kc_order;			// Slabs are 2^kc_order pages
+	int kc_perslab;			// Objects per slab
+	size_t kc_objoff;		// Offset of the first object in a slab
+	void (*kc_ctor)(void *obj);
+
+	struct spinlock kc_lock;
+	struct KmemSlab *kc_partial;	// Slabs with both used and free objects
+	struct KmemSlab *kc_full;	// Slabs with no free objects
+	struct KmemSlab *kc_empty;	// Slabs with no used objects
+	int kc_nslabs;
+	int kc_nempty;
+
+	struct KmemCpuCache kc_cpu[NCPU];
+};
+
+// Usage of a cache, as reported by kmem_cache_stats.
+struct KmemStats {
+	const char *name;
+	size_t size;			// Object size
+	int order;			// Slab order
+	int nslabs;
+	size_t total;			// Objects the slabs hold
+	size_t active;			// ... of which are allocated
+	size_t cached;			// ... or in CPU caches
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size,
+				    size_t align, void (*ctor)(void *));
+void *	kmem_cache_alloc(struct KmemCache *kc);
+void	kmem_cache_free(struct KmemCache *kc, void *obj);
+void	kmem_cache_shrink(struct KmemCache *kc);
+void	kmem_cache_destroy(struct KmemCache *kc);
+int	kmem_cache_stats(struct KmemStats *stats, int n);
+
+#endif	// !JOS_KERN_KMEM_H
@@ -7,8 +7,10 @@
 #include <inc/mmu.h>
 #include <inc/stdio.h>
 #include <inc/x86.h>
+#include <inc/error.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -32,6 +34,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -45,6 +48,13 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// How fast the timer counts, measured by the BSP, and how long a timer
+// tick lasts.  The timer counts at the bus frequency; we assume 1GHz if
+// we can't measure it.
+uint32_t lapic_timer_hz;
+unsigned lapic_timer_us;
+static uint32_t lapic_timer_count;	// Timer counts per tick
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +62,24 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Return how many times per second the timer counts, with divide-by-1,
+// or 0 if the 8253 timer doesn't work.
+static uint32_t
+lapic_timer_calibrate(void)
+{
+	uint32_t start, end;
+	bool ok;
+
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+	calibrate_start();
+	start = lapic[TCCR];
+	ok = calibrate_wait();
+	end = lapic[TCCR];
+	lapicw(TICR, 0);
+	return ok ? CALIBRATE_HZ(start - end) : 0;
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +93,18 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR],
+	// each time the scheduler starts it (lapic_timer_start), and then
+	// issues an interrupt.  The BSP measures how fast that is against
+	// the 8253 timer.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu) {
+		if ((lapic_timer_hz = lapic_timer_calibrate()) == 0)
+			lapic_timer_hz = 1000000000;
+		lapic_timer_set_quantum(TIMER_QUANTUM_US);
+	}
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -119,6 +152,39 @@ cpunum(void)
 	return 0;
 }
 
+//
+// Make timer ticks 'us' microseconds long, from the next tick on.
+// Returns -E_INVAL if that's shorter than TIMER_QUANTUM_MIN_US, or
+// longer than the timer can count.
+//
+int
+lapic_timer_set_quantum(unsigned us)
+{
+	uint64_t count = (uint64_t) lapic_timer_hz * us / 1000000;
+
+	if (us < TIMER_QUANTUM_MIN_US || count > 0xffffffff)
+		return -E_INVAL;
+	lapic_timer_us = us;
+	lapic_timer_count = count;
+	return 0;
+}
+
+// Have this CPU's timer interrupt once, a tick from now.
+void
+lapic_timer_start(void)
+{
+	if (lapic)
+		lapicw(TICR, lapic_timer_count);
+}
+
+// Stop this CPU's timer.
+void
+lapic_timer_stop(void)
+{
+	if (lapic)
+		lapicw(TICR, 0);
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
@@ -134,8 +200,6 @@ microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
-
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
@@ -180,3 +244,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the single CPU whose local APIC ID is 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
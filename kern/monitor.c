@@ -14,6 +14,10 @@
 #include <kern/trap.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/kmem.h>
+#include <kern/pagemerge.h>
+#include <kern/cpu.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -38,6 +42,13 @@ static struct Command commands[] = {
 	  mon_memdump },
 	{ "next", "Single-step to the next instruction.", mon_next },
 	{ "cont", "Resume execution of program", mon_cont },
+	{ "lockstat", "Display (or reset) spinlock contention statistics",
+	  mon_lockstat },
+	{ "kmem", "Display the usage of each kernel object cache", mon_kmem },
+	{ "pagemerge", "Display what same-page merging has saved",
+	  mon_pagemerge },
+	{ "quantum", "Display (or set) the length of a timer tick",
+	  mon_quantum },
 };
 
 static int
@@ -91,20 +102,12 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 		(used_pages * PGSIZE) / KB);
 	cprintf("Free:  %d (%dMB)\n", free_pages,
 		(free_pages * PGSIZE) / MB);
-	cprintf("Page_alloc'ed: %d\n", num_page_alloced);
+	cprintf("Page_alloc'ed: %d\n", num_alloced_pages());
+	cprintf("Pre-zeroed:    %d\n", num_zeroed_pages());
 	return 0;
 }
 
 
-static int
-page_is_free(struct PageInfo *pp)
-{
-	// You're free if
-	// 1. You're in the free list, or
-	// 2. You're the last page (link is NULL) and no one references you
-	return (pp->pp_link != NULL) ||
-		(pp == &pages[npages - 1] && pp->pp_ref == 0);
-}
 //  +---------------+ 0x8000000
 //  | Free:   32422 |
 //  +---------------+ 0x15A000
@@ -112,6 +115,8 @@ page_is_free(struct PageInfo *pp)
 //  +---------------+ 0x119000
 //  ...
 //  +---------------+ 0x0
+//
+// followed by the buddy allocator's statistics for each block order.
 int
 mon_physlayout(int argc, char **argv, struct Trapframe *tf)
 {
@@ -121,6 +126,8 @@ mon_physlayout(int argc, char **argv, struct Trapframe *tf)
 	int state_free;
 	int same_state_count;
 	struct PageInfo *pp;
+	struct PageOrderStats stats[MAX_ORDER + 1];
+	int order;
 
 	// 1. Print seperator and corresponding address
 	// 2. while same state (free vs used), increment count
@@ -131,8 +138,6 @@ mon_physlayout(int argc, char **argv, struct Trapframe *tf)
 		// which is the beginning of a new state and thus BELOW the seperator
 		cprintf("%s 0x%x\n", seperator, page2pa(pp+1));
 
-		// We add the pp->link != NULL condition for the last element
-		// on the free list: its pp->link will be NULL, but it is free
 		state_free = page_is_free(pp);
 		state_name = state_free ? "Free" : "Used";
 
@@ -150,6 +155,14 @@ mon_physlayout(int argc, char **argv, struct Trapframe *tf)
 	// Print last seperator and address (hopefully 0x0)
 	cprintf("%s 0x%x\n", seperator, page2pa(pp+1));
 
+	page_order_stats(stats);
+	cprintf("\nOrder  Block   Free     Allocs      Frees     Splits     Merges\n");
+	for (order = 0; order <= MAX_ORDER; order++)
+		cprintf("%5d %5dK %6d %10llu %10llu %10llu %10llu\n",
+			order, (PGSIZE << order) / KB, stats[order].free,
+			stats[order].allocs, stats[order].frees,
+			stats[order].splits, stats[order].merges);
+
 	return 0;
 }
 
@@ -200,7 +213,11 @@ mon_showmappings(int argc, char **argv, struct Trapframe *tf)
 		}
 		else
 		{
-			cprintf("-> %0#10x  ", PTE_ADDR(*pte));
+			if (*pte & PTE_PS)
+				cprintf("-> %0#10x  ", PTE_ADDR(*pte) +
+					(PTX(highaddr) << PTXSHIFT));
+			else
+				cprintf("-> %0#10x  ", PTE_ADDR(*pte));
 			// Kernel can always read
 			cprintf("R%c/%c%c\n",
 				(*pte & PTE_W) ? 'W' : '-',
@@ -417,6 +434,133 @@ mon_cont(int argc, char **argv, struct Trapframe *tf)
 	/* Never returns */
 }
 
+// Locks that share a name (e.g. every env's lock) are reported together:
+// counts are summed and the max hold time is the max over all of them.
+// Times are in TSC cycles.
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef SPINLOCK_STATS
+	struct {
+		char *name;
+		int nlocks;
+		uint64_t acquisitions;
+		uint64_t contended;
+		uint64_t spin_cycles;
+		uint64_t max_hold;
+	} classes[32];
+	int nclasses = 0;
+	int i;
+	struct spinlock *lk;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		spin_stats_reset();
+		return 0;
+	}
+	if (argc != 1)
+		return show_usage("%s [reset]", argv[0]);
+
+	for (lk = spin_stats_list; lk; lk = lk->stats_next) {
+		char *name = lk->name ? lk->name : "(unnamed)";
+
+		for (i = 0; i < nclasses; i++)
+			if (strcmp(classes[i].name, name) == 0)
+				break;
+		if (i == nclasses) {
+			if (nclasses == ARRAY_SIZE(classes))
+				continue;
+			memset(&classes[i], 0, sizeof(classes[i]));
+			classes[i].name = name;
+			nclasses++;
+		}
+
+		classes[i].nlocks++;
+		classes[i].acquisitions += lk->acquisitions;
+		classes[i].contended += lk->contended;
+		classes[i].spin_cycles += lk->spin_cycles;
+		if (lk->max_hold > classes[i].max_hold)
+			classes[i].max_hold = lk->max_hold;
+	}
+
+	cprintf("%-14s %5s %10s %10s %14s %10s %10s\n", "lock", "count",
+		"acquired", "contended", "spin cycles", "avg spin", "max hold");
+	for (i = 0; i < nclasses; i++)
+		cprintf("%-14s %5d %10llu %10llu %14llu %10llu %10llu\n",
+			classes[i].name, classes[i].nlocks,
+			classes[i].acquisitions, classes[i].contended,
+			classes[i].spin_cycles,
+			classes[i].contended ?
+			classes[i].spin_cycles / classes[i].contended : 0,
+			classes[i].max_hold);
+#else
+	cprintf("Spinlock statistics are disabled (see SPINLOCK_STATS).\n");
+#endif
+	return 0;
+}
+
+// Display each kmem cache: object size, slab size in pages, slabs,
+// objects in use, objects held by CPU caches, objects the slabs hold,
+// and total allocations and frees.
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	struct KmemStats stats[KMEM_NCACHES];
+	int i, n;
+
+	if (argc != 1)
+		return show_usage("%s", argv[0]);
+
+	n = kmem_cache_stats(stats, ARRAY_SIZE(stats));
+	cprintf("%-14s %6s %5s %6s %8s %7s %8s %10s %10s\n", "cache", "size",
+		"pages", "slabs", "active", "cached", "total", "allocs",
+		"frees");
+	for (i = 0; i < n; i++)
+		cprintf("%-14s %6u %5d %6d %8u %7u %8u %10llu %10llu\n",
+			stats[i].name, stats[i].size, 1 << stats[i].order,
+			stats[i].nslabs, stats[i].active, stats[i].cached,
+			stats[i].total, stats[i].allocs, stats[i].frees);
+	return 0;
+}
+
+// Display the page merger's passes, pages hashed and merged, and the
+// stable pages with the mappings they stand in for.
+int
+mon_pagemerge(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PageMergeStats stats;
+
+	if (argc != 1)
+		return show_usage("%s", argv[0]);
+
+	page_merge_stats(&stats);
+	cprintf("passes %u, pages hashed %llu, merged %llu\n", stats.rounds,
+		stats.scanned, stats.merged);
+	cprintf("%d stable pages standing in for %u mappings\n",
+		stats.nstable, stats.sharing);
+	return 0;
+}
+
+int
+mon_quantum(int argc, char **argv, struct Trapframe *tf)
+{
+	char *end;
+	long us;
+
+	if (argc == 2) {
+		us = strtol(argv[1], &end, 0);
+		if (*end != '\0' || us <= 0 ||
+		    lapic_timer_set_quantum(us) < 0) {
+			cprintf("Bad quantum: %s\n", argv[1]);
+			return 0;
+		}
+	} else if (argc != 1)
+		return show_usage("%s [microseconds]", argv[0]);
+
+	cprintf("timer ticks every %u us; timer runs at %u kHz\n",
+		lapic_timer_us, lapic_timer_hz / 1000);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -21,5 +21,9 @@ int mon_chgmappings(int argc, char **argv, struct Trapframe *tf);
 int mon_memdump(int argc, char **argv, struct Trapframe *tf);
 int mon_next(int argc, char **argv, struct Trapframe *tf);
 int mon_cont(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
+int mon_pagemerge(int argc, char **argv, struct Trapframe *tf);
+int mon_quantum(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -0,0 +1,247 @@
+// Same-page merging.
+//
+// Idle CPUs scan the address spaces of the environments that opted in
+// with sys_env_set_mergeable, a few pages at a time, looking for pages
+// with the same contents.  Content seen twice in a pass gets a "stable"
+// copy that the merger holds a reference to, and from then on every
+// mapping of that content is pointed at the stable page, so that the
+// duplicates can be freed.
+//
+// Only pages nobody can write are merged: copy-on-write mappings, and
+// read-only mappings of pages with no other reference.  Stable pages are
+// only ever mapped read-only or copy-on-write, and since the merger keeps
+// a reference, page_cow always copies them.  Page tables only change
+// under their env's lock, and we leave envs alone while a CPU is using
+// them, so no TLB still caches a mapping we change.
+//
+// Pages seen once in the current pass are remembered by hash and identity
+// only, without a reference; that table is cleared after each pass.
+// Stable pages are dropped once the merger's is their last reference.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/pagemerge.h>
+
+#define MERGE_NSTABLE	512	// Stable page table slots
+#define MERGE_NSEEN	1024	// Seen-once table slots
+#define MERGE_PROBE	4	// Stable slots tried for each hash
+#define MERGE_SCAN	1024	// Page table entries looked at per call
+#define MERGE_HASHES	32	// Pages hashed per call
+
+struct MergeEntry {
+	uint32_t me_hash;
+	struct PageInfo *me_page;	// NULL if the slot is free
+};
+
+static struct MergeEntry merge_stable[MERGE_NSTABLE];
+static struct MergeEntry merge_seen[MERGE_NSEEN];
+
+// Where the scan is: the env, and the next va to look at in it.
+static size_t merge_envx;
+static uintptr_t merge_va;
+static int merge_prune;		// Next stable slot to check for pruning
+
+static struct PageMergeStats merge_stats;
+
+// Set while a CPU runs the merger; the others don't wait for it.
+static volatile uint32_t merge_busy;
+
+static uint32_t
+page_hash(struct PageInfo *pp)
+{
+	uint32_t *p = page2kva(pp);
+	uint32_t h = 2166136261;	// FNV-1a, a word at a time
+	int i;
+
+	for (i = 0; i < PGSIZE / sizeof(*p); i++)
+		h = (h ^ p[i]) * 16777619;
+	return h;
+}
+
+// Return the stable page with the same contents as pp, which hashes to
+// h, or NULL if there's none.
+static struct PageInfo *
+stable_find(uint32_t h, struct PageInfo *pp)
+{
+	struct MergeEntry *me;
+	int i;
+
+	for (i = 0; i < MERGE_PROBE; i++) {
+		me = &merge_stable[(h + i) % MERGE_NSTABLE];
+		if (me->me_page != NULL && me->me_hash == h &&
+		    (me->me_page == pp ||
+		     memcmp(page2kva(me->me_page), page2kva(pp), PGSIZE) == 0))
+			return me->me_page;
+	}
+	return NULL;
+}
+
+// Make a stable copy of pp, which hashes to h.  Returns NULL if there's
+// no room or no memory for it.
+static struct PageInfo *
+stable_insert(uint32_t h, struct PageInfo *pp)
+{
+	struct MergeEntry *me;
+	struct PageInfo *sp;
+	int i;
+
+	for (i = 0; i < MERGE_PROBE; i++) {
+		me = &merge_stable[(h + i) % MERGE_NSTABLE];
+		if (me->me_page == NULL)
+			break;
+	}
+	if (i == MERGE_PROBE || (sp = page_alloc(0)) == NULL)
+		return NULL;
+
+	memcpy(page2kva(sp), page2kva(pp), PGSIZE);
+	page_incref(sp);
+	me->me_hash = h;
+	me->me_page = sp;
+	merge_stats.nstable++;
+	return sp;
+}
+
+// Drop the stable page in the next slot if nobody maps it anymore.  Then
+// nobody can add a mapping of it either.
+static void
+stable_prune(void)
+{
+	struct MergeEntry *me = &merge_stable[merge_prune];
+
+	merge_prune = (merge_prune + 1) % MERGE_NSTABLE;
+	if (me->me_page != NULL && me->me_page->pp_ref == 1) {
+		page_decref(me->me_page);
+		me->me_page = NULL;
+		merge_stats.nstable--;
+	}
+}
+
+// Merge the page that *pte maps at 'va' in e, if it's a duplicate.  The
+// caller holds e's lock, and *pte is a present, read-only user mapping.
+static void
+merge_pte(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct PageInfo *pp, *sp;
+	struct MergeEntry *seen;
+	uint32_t h;
+
+	pp = pa2page(PTE_ADDR(*pte));
+	if (!(*pte & PTE_COW) && pp->pp_ref != 1)
+		return;
+
+	h = page_hash(pp);
+	merge_stats.scanned++;
+	if ((sp = stable_find(h, pp)) == NULL) {
+		seen = &merge_seen[h % MERGE_NSEEN];
+		if (seen->me_page == NULL || seen->me_hash != h ||
+		    seen->me_page == pp) {
+			seen->me_hash = h;
+			seen->me_page = pp;
+			return;
+		}
+		// The second page with this hash in this pass: the first
+		// one gets merged when the next pass gets to it.
+		seen->me_page = NULL;
+		if ((sp = stable_insert(h, pp)) == NULL)
+			return;
+	}
+	if (sp == pp)
+		return;
+
+	page_incref(sp);
+	*pte = page2pa(sp) | PGOFF(*pte);
+	tlb_invalidate(e->env_pgdir, (void *) va);
+	page_decref(pp);
+	merge_stats.merged++;
+}
+
+static void
+merge_next_env(void)
+{
+	merge_envx++;
+	merge_va = 0;
+}
+
+//
+// Called by idle CPUs: scan on through the address spaces of mergeable
+// envs, merging the duplicate pages found.  Each call does a bounded
+// amount of work.
+//
+void
+page_merge_idle(void)
+{
+	struct Env *e;
+	pde_t pde;
+	pte_t *pte;
+	int scan = MERGE_SCAN, hashes = MERGE_HASHES;
+
+	if (xchg(&merge_busy, 1) != 0)
+		return;
+	stable_prune();
+
+	while (scan > 0 && hashes > 0) {
+		if (merge_envx >= env_nslots) {
+			merge_envx = 0;
+			merge_va = 0;
+			memset(merge_seen, 0, sizeof(merge_seen));
+			merge_stats.rounds++;
+			break;
+		}
+
+		e = &envs[merge_envx];
+		scan--;
+		if (!e->env_merge) {
+			merge_next_env();
+			continue;
+		}
+		env_lock(e);
+		if (!e->env_merge || e->env_status == ENV_FREE ||
+		    e->env_status == ENV_DYING || e->env_cpu != NULL) {
+			env_unlock(e);
+			merge_next_env();
+			continue;
+		}
+
+		while (merge_va < UTOP && scan > 0 && hashes > 0) {
+			scan--;
+			pde = e->env_pgdir[PDX(merge_va)];
+			if (!(pde & PTE_P) || (pde & PTE_PS)) {
+				merge_va = ROUNDUP(merge_va + 1, PTSIZE);
+				continue;
+			}
+			pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(merge_va);
+			if ((*pte & (PTE_P | PTE_U | PTE_W | PTE_SHARE)) ==
+			    (PTE_P | PTE_U)) {
+				merge_pte(e, merge_va, pte);
+				hashes--;
+			}
+			merge_va += PGSIZE;
+		}
+		env_unlock(e);
+		if (merge_va >= UTOP)
+			merge_next_env();
+	}
+
+	merge_busy = 0;
+}
+
+//
+// Copy the merger's statistics to 'stats'.  The figures aren't a
+// consistent snapshot.
+//
+void
+page_merge_stats(struct PageMergeStats *stats)
+{
+	struct PageInfo *sp;
+	int i;
+
+	*stats = merge_stats;
+	stats->sharing = 0;
+	for (i = 0; i < MERGE_NSTABLE; i++)
+		if ((sp = merge_stable[i].me_page) != NULL)
+			stats->sharing += sp->pp_ref - 1;
+}
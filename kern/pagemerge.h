@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PAGEMERGE_H
+#define JOS_KERN_PAGEMERGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// What the page merger has done so far, as reported by page_merge_stats.
+struct PageMergeStats {
+	uint32_t rounds;		// Full passes over envs[]
+	uint64_t scanned;		// Pages hashed
+	uint64_t merged;		// Mappings pointed at a stable page
+	int nstable;			// Stable pages held
+	size_t sharing;			// Mappings of the stable pages
+};
+
+void	page_merge_idle(void);
+void	page_merge_stats(struct PageMergeStats *stats);
+
+#endif	// !JOS_KERN_PAGEMERGE_H
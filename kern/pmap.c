@@ -11,6 +11,7 @@
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <kern/cpuid.h>
+#include <kern/spinlock.h>
 
 
 // These variables are set by i386_detect_memory()
@@ -20,11 +21,72 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *page_free_lists[MAX_ORDER + 1];	// Free blocks, by order
+static struct PageOrderStats order_stats[MAX_ORDER + 1];
 static bool pse_avail;
-
-// Num pages allocated by page_alloc
-size_t num_page_alloced = 0;
+static bool pge_avail;
+
+// Bumped whenever page tables change that may be loaded on another CPU,
+// whose TLB then needs a flush before it trusts them again.
+static volatile uint32_t tlb_gen;
+
+// Num pages off the free lists (including the ones in CPU page caches)
+static size_t num_page_alloced = 0;
+
+// Protects page_free_lists, order_stats, num_page_alloced and every
+// pp_order.  pp_ref is updated atomically.  Page tables themselves are
+// protected by the lock of the env that owns them.
+static struct spinlock page_lock = {
+	.name = "page_lock"
+};
+
+// Each CPU keeps a small cache of free pages in front of the free lists,
+// so that most page_alloc and page_free calls neither take page_lock nor
+// write shared cache lines.  Pages move between a cache and the free
+// lists PAGE_CACHE_BATCH at a time.  pc_lock is almost always taken by
+// the cache's own CPU, so it stays in that CPU's cache; other CPUs only
+// take it to drain the cache when the free lists run dry.  pc_lock comes
+// before page_lock, and a CPU never holds two of them.
+#define PAGE_CACHE_SIZE		32
+#define PAGE_CACHE_BATCH	16
+
+struct PageCache {
+	struct spinlock pc_lock;
+	struct PageInfo *pc_pages[PAGE_CACHE_SIZE];
+	int pc_count;
+} __attribute__((aligned(64)));
+
+static struct PageCache page_caches[NCPU] = {
+	[0 ... NCPU - 1] = { .pc_lock = { .name = "page_cache_lock" } }
+};
+
+static bool page_cache_reclaim(void);
+
+// Free pages that idle CPUs have zeroed ahead of time, linked through
+// pp_link, for page_alloc(ALLOC_ZERO).  Idle CPUs stop zeroing once there
+// are ZERO_POOL_MAX of them.  Protected by zero_lock, which is never held
+// with page_lock.
+#define ZERO_POOL_MAX		256
+#define ZERO_BATCH		16
+
+static struct PageInfo *zero_pages;
+static volatile size_t nzero_pages;
+static struct spinlock zero_lock = {
+	.name = "zero_lock"
+};
+
+// Page directories of dead environments that haven't been freed yet,
+// linked through the pp_link of their pages.  Idle CPUs free them, or
+// page_alloc when it runs out of memory.  Past REAP_MAX of them,
+// pgdir_release frees them right away.  Protected by reap_lock, which is
+// never held with any other lock.
+#define REAP_MAX		16
+
+static struct PageInfo *reap_list;
+static volatile size_t nreap;
+static struct spinlock reap_lock = {
+	.name = "reap_lock"
+};
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -71,6 +133,8 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static struct PageInfo *zero_pool_get(void);
+static struct PageInfo *buddy_alloc(int order);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -142,23 +206,18 @@ void
 mem_init(void)
 {
 	uint32_t cr0;
-	uint32_t cr4;
 	size_t n;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
-	// We turn off 4Mb paging because it would require changing most
-	// functions (e.g. pgdir_walk and all the ones that use it)
-	// so that they know what a superpage is.
-	if (/*cpu_hasedxfeat(CPUID_FEAT_EDX_PSE)*/ 0)
-	{
-		cr4 = rcr4();
-		cr4 |= CR4_PSE;
-		lcr4(cr4);
-		pse_avail = true;
-	}
-
+	// Map the kernel's view of physical memory with 4MB pages if we can:
+	// it takes no page tables and far fewer TLB entries.
+	pse_avail = cpu_hasedxfeat(CPUID_FEAT_EDX_PSE);
+	// The kernel's mappings are the same in every address space, so they
+	// are global and stay in the TLB across env switches.
+	pge_avail = cpu_hasedxfeat(CPUID_FEAT_EDX_PGE);
+	mem_init_percpu();
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
@@ -181,17 +240,11 @@ mem_init(void)
 	// each physical page, there is a corresponding struct PageInfo in this
 	// array.  'npages' is the number of physical pages in memory.  Use memset
 	// to initialize all fields of each struct PageInfo to 0.
-	// size of array: 384 Kb (0x8000 pages * 6 bytes/page = 0x30000),
-	// will take 30 pages to store
+	// size of array: 384 Kb (0x8000 pages * 12 bytes/page = 0x60000),
+	// will take 96 pages to store
 	pages = boot_alloc(npages * sizeof(*pages));
 	memset(pages, 0, npages * sizeof(*pages));
 
-	//////////////////////////////////////////////////////////////////////
-	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
-	// LAB 3: Your code here.
-	envs = boot_alloc(NENV * sizeof(*envs));
-	memset(envs, 0, sizeof(*envs));
-
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -214,6 +267,8 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
+	// The system information page goes at the top (see sysinfo_init).
+	assert(npages * sizeof(*pages) <= UINFO - UPAGES);
 	boot_map_region(kern_pgdir, UPAGES, npages * sizeof(*pages),
 			PADDR(pages), PTE_U);
 
@@ -224,8 +279,16 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, NENV * sizeof(*envs),
-			PADDR(envs), PTE_U);
+	// envs[] is mapped a page at a time as it grows (see env_grow), at
+	// KENVS for the kernel and at UENVS for the user.  Make the page
+	// tables for both now, so that every address space shares them and
+	// sees the new pages right away.
+	static_assert(NENV * sizeof(struct Env) <= PTSIZE);
+	static_assert(KENVS + NENV * sizeof(struct Env) <=
+		      KSTACKTOPCPU(NCPU - 1) - KSTKSIZE - KSTKGAP);
+	if (pgdir_walk(kern_pgdir, (void *) UENVS, 1) == NULL ||
+	    pgdir_walk(kern_pgdir, (void *) KENVS, 1) == NULL)
+		panic("mem_init: no memory for the envs page tables");
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -251,7 +314,7 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KERNBASE, (size_t)~0 - KERNBASE + 1,
-			0, PTE_W);
+			0, PTE_W | PTE_G);
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -312,21 +375,111 @@ mem_init_mp(void)
 	for (i = 0; i < NCPU; i++)
 	{
 		boot_map_region(kern_pgdir, KSTACKTOPCPU(i) - KSTKSIZE, KSTKSIZE,
-				PADDR(percpu_kstacks[i]), PTE_W);
+				PADDR(percpu_kstacks[i]), PTE_W | PTE_G);
 	}
 }
 
+// Per-CPU paging setup; every CPU must run this before loading kern_pgdir,
+// whose superpages need CR4_PSE.
+void
+mem_init_percpu(void)
+{
+	if (pse_avail)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_avail)
+		lcr4(rcr4() | CR4_PGE);
+}
+
+// Can we map 4MB pages?
+bool
+superpages_avail(void)
+{
+	return pse_avail;
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept in buddy blocks
+// on one linked list per block order.
 // --------------------------------------------------------------
 
+// Put block pp, of 2^order pages, on its free list.
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_lists[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_lists[order] = pp;
+	order_stats[order].free++;
+}
+
+// Take free block pp off its free list.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	int order = pp->pp_order;
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_lists[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = NULL;
+	pp->pp_prev = NULL;
+	pp->pp_order = PP_ORDER_NONE;
+	order_stats[order].free--;
+}
+
+// Free the block of 2^order pages starting at page i, merging it with its
+// buddy for as long as the buddy is free too.
+static void
+buddy_insert(size_t i, int order)
+{
+	size_t buddy;
+
+	for (; order < MAX_ORDER; order++) {
+		buddy = i ^ (1 << order);
+		if (buddy >= npages || pages[buddy].pp_order != order)
+			break;
+		buddy_remove(&pages[buddy]);
+		i &= ~(1 << order);
+		order_stats[order + 1].merges++;
+	}
+	buddy_push(&pages[i], order);
+}
+
+// Put the pages [start, end) on the free lists, as the largest aligned
+// blocks that fit, from the top down so that the lowest block of each
+// order ends up first.  Returns the number of pages.
+static size_t
+page_init_range(size_t start, size_t end)
+{
+	size_t n = 0;
+	int order;
+
+	while (end > start) {
+		for (order = MAX_ORDER;
+		     order > 0 && (end % (1 << order) != 0 ||
+				   end < start + (1 << order));
+		     order--)
+			;
+		end -= 1 << order;
+		buddy_push(&pages[end], order);
+		n += 1 << order;
+	}
+	return n;
+}
+
 //
-// Initialize page structure and memory free list.
+// Initialize page structure and memory free lists.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the page_free_lists.
 //
 void
 page_init(void)
@@ -354,35 +507,24 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	// We make sure to put pages at a low physical address at the beginning
-	// of the list.
+	// We free the highest ranges first, so that pages at a low physical
+	// address are at the beginning of the lists.
 	size_t extmem_free;
 	size_t basemem_free;
 	size_t i;
 	size_t first_free_extmem_page_i;
 
-	extmem_free = 0;
-	basemem_free = 0;
+	for (i = 0; i < npages; i++)
+		pages[i].pp_order = PP_ORDER_NONE;
 
 	first_free_extmem_page_i = PADDR(boot_alloc(0)) / PGSIZE;
 	clogf(LOG_DEBUG, "page_init", "Initial extmem address: 0x%x\n",
 		PADDR(boot_alloc(0)));
-	for (i = npages - 1; i >= first_free_extmem_page_i; i--) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-		extmem_free++;
-	}
+	extmem_free = page_init_range(first_free_extmem_page_i, npages);
 
-	for (i = npages_basemem - 1; i >= 1; i--) {
-		if (page2pa(&pages[i]) == MPENTRY_PADDR)
-			continue;
-
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-		basemem_free++;
-	}
+	basemem_free = page_init_range(PGNUM(MPENTRY_PADDR) + 1,
+				       npages_basemem);
+	basemem_free += page_init_range(1, PGNUM(MPENTRY_PADDR));
 
 	clogf(LOG_DEBUG, "page_init", "Initial number of free pages: %d "
 	      "(base: %d, ext: %d)\n",
@@ -404,44 +546,296 @@ page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	struct PageInfo *alloced_page;
-	if (page_free_list == NULL)
-		return NULL;
+	struct PageCache *pc = &page_caches[cpunum()];
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_ZERO) && (pp = zero_pool_get()) != NULL)
+		return pp;
 
-	alloced_page = page_free_list;
-	page_free_list = page_free_list->pp_link;
+	spin_lock(&pc->pc_lock);
+	if (pc->pc_count == 0) {
+		spin_lock(&page_lock);
+		while (pc->pc_count < PAGE_CACHE_BATCH &&
+		       (pp = buddy_alloc(0)) != NULL) {
+			pp->pp_order = PP_ORDER_CACHED;
+			pc->pc_pages[pc->pc_count++] = pp;
+		}
+		spin_unlock(&page_lock);
+		// Before giving up, take back the pages sitting in other
+		// CPUs' caches and free the address spaces waiting to be
+		// freed.  The zero pool is the last resort for any page.
+		if (pc->pc_count == 0) {
+			spin_unlock(&pc->pc_lock);
+			if ((pp = zero_pool_get()) != NULL ||
+			    !(page_cache_reclaim() || pgdir_reap(true)))
+				return pp;
+			return page_alloc(alloc_flags);
+		}
+	}
 
-	alloced_page->pp_link = NULL;
+	pp = pc->pc_pages[--pc->pc_count];
+	spin_unlock(&pc->pc_lock);
+	pp->pp_order = PP_ORDER_NONE;
 	if (alloc_flags & ALLOC_ZERO) {
-		memset(page2kva(alloced_page), 0, PGSIZE);
+		memset(page2kva(pp), 0, PGSIZE);
 	}
 
-	// Stats
-	num_page_alloced++;
+	return pp;
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// splitting the smallest free block that is large enough.  Flags and
+// reference counts are as for page_alloc; pass the first page to
+// page_free_order with the same order to free the block.
+//
+// Returns NULL if there's no free block that large.
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp == NULL && (page_cache_reclaim() || pgdir_reap(true)))
+		return page_alloc_order(order, alloc_flags);
 
-	return alloced_page;
+	// The pages are ours now; no need to hold the lock while clearing.
+	if (pp != NULL && (alloc_flags & ALLOC_ZERO)) {
+		memset(page2kva(pp), 0, PGSIZE << order);
+	}
+
+	return pp;
+}
+
+// Take a page off the zero pool, or return NULL if it's empty.
+static struct PageInfo *
+zero_pool_get(void)
+{
+	struct PageInfo *pp;
+
+	if (nzero_pages == 0)
+		return NULL;
+
+	spin_lock(&zero_lock);
+	if ((pp = zero_pages) != NULL) {
+		zero_pages = pp->pp_link;
+		nzero_pages--;
+	}
+	spin_unlock(&zero_lock);
+
+	if (pp != NULL) {
+		pp->pp_link = NULL;
+		pp->pp_order = PP_ORDER_NONE;
+	}
+	return pp;
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Called by idle CPUs: zero a few free pages, so that page_alloc can
+// hand them out for ALLOC_ZERO without a memset.
 //
 void
-page_free(struct PageInfo *pp)
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < ZERO_BATCH && nzero_pages < ZERO_POOL_MAX; i++) {
+		spin_lock(&page_lock);
+		pp = buddy_alloc(0);
+		spin_unlock(&page_lock);
+		if (pp == NULL)
+			return;
+
+		pp->pp_order = PP_ORDER_CACHED;
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&zero_lock);
+		pp->pp_link = zero_pages;
+		zero_pages = pp;
+		nzero_pages++;
+		spin_unlock(&zero_lock);
+	}
+}
+
+// Take a block of 2^order pages off the free lists, splitting the
+// smallest free block that is large enough.  The caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= MAX_ORDER && page_free_lists[k] == NULL; k++)
+		;
+	if (k > MAX_ORDER)
+		return NULL;
+
+	pp = page_free_lists[k];
+	buddy_remove(pp);
+	// Keep the lower half, and free the upper half.
+	while (k > order) {
+		order_stats[k].splits++;
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+
+	// Stats
+	order_stats[order].allocs++;
+	num_page_alloced += 1 << order;
+	return pp;
+}
+
+// Put a block of 2^order pages back on the free lists.  The caller holds
+// page_lock.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	pp->pp_order = PP_ORDER_NONE;
+	buddy_insert(pp - pages, order);
+
+	// Stats
+	order_stats[order].frees++;
+	num_page_alloced -= 1 << order;
+}
+
+// Move the n coldest pages of pc to the free lists.  The caller holds
+// page_lock.
+static void
+page_cache_drain(struct PageCache *pc, int n)
+{
+	int i;
+
+	n = MIN(n, pc->pc_count);
+	for (i = 0; i < n; i++)
+		buddy_free(pc->pc_pages[i], 0);
+	pc->pc_count -= n;
+	memmove(pc->pc_pages, pc->pc_pages + n,
+		pc->pc_count * sizeof(pc->pc_pages[0]));
+}
+
+// Move every page in the other CPUs' caches to the free lists, for when
+// the free lists alone can't satisfy an allocation.  The caller holds
+// neither pc_lock nor page_lock.  Returns true if any pages moved.
+static bool
+page_cache_reclaim(void)
+{
+	struct PageCache *pc;
+	bool moved = false;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		pc = &page_caches[i];
+		if (i == cpunum() || pc->pc_count == 0)
+			continue;
+		spin_lock(&pc->pc_lock);
+		spin_lock(&page_lock);
+		moved |= pc->pc_count > 0;
+		page_cache_drain(pc, pc->pc_count);
+		spin_unlock(&page_lock);
+		spin_unlock(&pc->pc_lock);
+	}
+	return moved;
+}
+
+// Panic unless pp can be freed as a block of 2^order pages.
+static void
+page_free_check(struct PageInfo *pp, int order)
 {
 	if (pp == NULL)
 		_panic(__FILE__, __LINE__, "page_free: PageInfo is NULL");
 	else if (pp->pp_ref != 0)
 		_panic(__FILE__, __LINE__, "page_free: Ref count is nonzero (%d)",
 			pp->pp_ref);
-	else if (pp->pp_link != NULL)
-		_panic(__FILE__, __LINE__, "page_free: PageInfo's pp_link is not NULL");
+	else if (pp->pp_link != NULL || pp->pp_order != PP_ORDER_NONE)
+		_panic(__FILE__, __LINE__, "page_free: PageInfo is already free");
+	else if (order < 0 || order > MAX_ORDER ||
+		 (pp - pages) % (1 << order) != 0)
+		_panic(__FILE__, __LINE__, "page_free: Bad order %d for page %d",
+			order, pp - pages);
+}
 
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+
+	page_free_check(pp, 0);
+	spin_lock(&pc->pc_lock);
+	if (pc->pc_count == PAGE_CACHE_SIZE) {
+		spin_lock(&page_lock);
+		page_cache_drain(pc, PAGE_CACHE_BATCH);
+		spin_unlock(&page_lock);
+	}
+	pp->pp_order = PP_ORDER_CACHED;
+	pc->pc_pages[pc->pc_count++] = pp;
+	spin_unlock(&pc->pc_lock);
+}
 
-	// Stats
-	num_page_alloced--;
+//
+// Return a block from page_alloc_order to the free lists.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+
+	page_free_check(pp, order);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Is pp part of a free block?
+//
+bool
+page_is_free(struct PageInfo *pp)
+{
+	size_t i = pp - pages;
+	int order;
+
+	if (pp->pp_order == PP_ORDER_CACHED)
+		return true;
+	for (order = 0; order <= MAX_ORDER; order++)
+		if (pages[i & ~((1 << order) - 1)].pp_order == order)
+			return true;
+	return false;
+}
+
+//
+// Copy the buddy allocator's statistics, for orders 0 to MAX_ORDER, to
+// 'stats'.  Order 0 counts the pages moving in and out of CPU caches.
+//
+void
+page_order_stats(struct PageOrderStats *stats)
+{
+	spin_lock(&page_lock);
+	memcpy(stats, order_stats, sizeof(order_stats));
+	spin_unlock(&page_lock);
+}
+
+//
+// Increment the reference count on a page.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	__sync_fetch_and_add(&pp->pp_ref, 1);
 }
 
 //
@@ -451,14 +845,27 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
 		page_free(pp);
 }
 
+//
+// Decrement the reference count on the superpage starting at pp,
+// freeing the whole block if there are no more refs.
+//
+static void
+superpage_decref(struct PageInfo *pp)
+{
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
+		page_free_order(pp, SUPERPAGE_ORDER);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) or PDE (large page) for
 // linear address 'va'.
 // This requires walking the two-level page table structure.
+// If 'va' lies in a superpage, the PDE is returned as is, even when
+// create is true: check for PTE_PS before storing a 4KB mapping in it.
 //
 // The relevant page table page might not exist yet.
 // If this is true, and create == false, then pgdir_walk returns NULL.
@@ -485,10 +892,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 
 	va_pde = pgdir + PDX(va);
 
-	// Make sure something breaks if we used pgdir_walk on a super pgdir entry.
-	// This is a temporary solution which doesn't change pgdir_walk's interface.
 	if ((*va_pde & PTE_PS) && (*va_pde & PTE_P))
-		return NULL;
+		return va_pde;
 
 	if (!(*va_pde & PTE_P))
 	{
@@ -598,20 +1003,65 @@ int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	pte_t *pte;
+	bool super;
 
 	pte = pgdir_walk(pgdir, va, 1);
 	if (pte == NULL)
 		return -E_NO_MEM;
+	super = (*pte & PTE_PS);
 
-	pp->pp_ref++;
+	page_incref(pp);
 
 	// If pp refers to the pa that is already mapped, page_remove won't
 	// free our physical page because we pre-incremented pp->pp_ref.
 	page_remove(pgdir, va);
 
+	// A superpage there took the whole 4MB with it, and there is no
+	// page table for our PTE yet.
+	if (super && (pte = pgdir_walk(pgdir, va, 1)) == NULL) {
+		page_decref(pp);
+		return -E_NO_MEM;
+	}
+
 	*pte = page2pa(pp) | perm | PTE_P;
 	return 0;
 }
+
+//
+// Map the superpage starting at 'pp', a block of order SUPERPAGE_ORDER, at
+// the 4MB-aligned virtual address 'va', with permissions 'perm|PTE_PS|PTE_P'.
+// Whatever was mapped in [va, va+PTSIZE) before is removed, and the page
+// table that held it, if any, is freed.  pp->pp_ref is incremented.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the CPU has no 4MB pages or 'va' isn't 4MB-aligned
+//
+int
+page_insert_super(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pt;
+	char *p;
+
+	if (!pse_avail || (uintptr_t) va % PTSIZE != 0)
+		return -E_INVAL;
+
+	page_incref(pp);
+
+	if ((*pde & PTE_P) && !(*pde & PTE_PS)) {
+		for (p = va; p < (char *) va + PTSIZE; p += PGSIZE)
+			page_remove(pgdir, p);
+		pt = pa2page(PTE_ADDR(*pde));
+		*pde = 0;
+		tlb_invalidate(pgdir, va);
+		page_decref(pt);
+	} else
+		page_remove(pgdir, va);
+
+	*pde = page2pa(pp) | perm | PTE_PS | PTE_P;
+	return 0;
+}
 
 //
 // Return the page mapped at virtual address 'va'.
@@ -621,6 +1071,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// If va lies in a superpage, this returns the 4KB page of it containing
+// va and stores the address of the PDE.  Only the superpage's first page
+// holds a reference count, so callers must not take references on the
+// page returned for a PTE_PS mapping.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -637,6 +1091,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 		*pte_store = pte;
 
 	pa = PTE_ADDR(*pte);
+	if (*pte & PTE_PS)
+		pa += PTX(va) << PTXSHIFT;
 
 	return pa2page(pa);
 }
@@ -653,6 +1109,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
 //
+// If va lies in a superpage, the whole superpage is unmapped.
+//
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
@@ -660,18 +1118,437 @@ void
 page_remove(pde_t *pgdir, void *va)
 {
 	pte_t *pte;
+	pte_t old;
 	struct PageInfo *page_info;
 
 	page_info = page_lookup(pgdir, va, &pte);
 	if (!page_info)
 		return;
 
+	// Invalidate before dropping our reference: once the page is free,
+	// another CPU may reuse it while a stale TLB entry still maps it.
+	old = *pte;
 	*pte = 0;
-	page_decref(page_info);
-	if (page_info->pp_ref == 0)
+	tlb_invalidate(pgdir, va);
+	if (old & PTE_PS)
+		superpage_decref(pa2page(PTE_ADDR(old)));
+	else
+		page_decref(page_info);
+}
+
+//
+// The page range functions below act on the 'npages' pages from the
+// page-aligned 'va', walking the page tables once per page table rather
+// than once per page.  Like page_remove, they unmap a superpage in the
+// way as a whole.  On error, some of the pages may have been done already.
+//
+
+// Return the PTEs for [va, va + n pages) of pgdir, which must all lie in
+// the same page table.  With 'create', a superpage there is unmapped and
+// a missing page table allocated, else NULL is returned for either.
+static pte_t *
+pgdir_walk_range(pde_t *pgdir, void *va, int create)
+{
+	pte_t *pte;
+
+	if ((pte = pgdir_walk(pgdir, va, create)) == NULL || !(*pte & PTE_PS))
+		return pte;
+	if (!create)
+		return NULL;
+	page_remove(pgdir, va);
+	return pgdir_walk(pgdir, va, 1);
+}
+
+// Point 'pte', for 'va' in 'pgdir', at pp, dropping the page it mapped.
+static void
+pte_insert(pde_t *pgdir, pte_t *pte, void *va, struct PageInfo *pp, int perm)
+{
+	pte_t old = *pte;
+
+	page_incref(pp);
+	*pte = page2pa(pp) | perm | PTE_P;
+	if (old & PTE_P) {
 		tlb_invalidate(pgdir, va);
+		page_decref(pa2page(PTE_ADDR(old)));
+	}
+}
+
+// Clear 'pte', for 'va' in 'pgdir', dropping the page it mapped.
+static void
+pte_remove(pde_t *pgdir, pte_t *pte, void *va)
+{
+	pte_t old = *pte;
+
+	*pte = 0;
+	tlb_invalidate(pgdir, va);
+	page_decref(pa2page(PTE_ADDR(old)));
+}
+
+//
+// Map fresh zeroed pages at [va, va + npages pages) in 'pgdir', as with
+// page_insert.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page or page table couldn't be allocated
+//
+int
+page_alloc_range(pde_t *pgdir, void *va, size_t npages, int perm)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t i, n;
+
+	for ( ; npages > 0; npages -= n) {
+		n = MIN(npages, NPTENTRIES - PTX(va));
+		if ((pte = pgdir_walk_range(pgdir, va, 1)) == NULL)
+			return -E_NO_MEM;
+		for (i = 0; i < n; i++, pte++, va += PGSIZE) {
+			if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+				return -E_NO_MEM;
+			pte_insert(pgdir, pte, va, pp, perm);
+		}
+	}
+	return 0;
+}
+
+//
+// Map the pages at [srcva, srcva + npages pages) in 'src' at 'dstva' in
+// 'dst' with 'perm', as with page_insert.  'src' and 'dst' may be the same.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if a source page isn't mapped or is in a superpage, or
+//	(perm & PTE_W) but a source page is read-only
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+page_map_range(pde_t *dst, void *dstva, pde_t *src, void *srcva,
+	       size_t npages, int perm)
+{
+	pte_t *spte, *dpte;
+	void *va;
+	size_t i, n, left;
+
+	// Check the whole source range before touching dst, so that a bad
+	// source leaves dst as it was.
+	for (va = srcva, left = npages; left > 0; left -= n) {
+		n = MIN(left, NPTENTRIES - PTX(va));
+		if ((spte = pgdir_walk_range(src, va, 0)) == NULL)
+			return -E_INVAL;
+		for (i = 0; i < n; i++, spte++, va += PGSIZE)
+			if (!(*spte & PTE_P) ||
+			    ((perm & PTE_W) && !(*spte & PTE_W)))
+				return -E_INVAL;
+	}
+
+	for ( ; npages > 0; npages -= n) {
+		n = MIN(npages, NPTENTRIES - PTX(srcva));
+		n = MIN(n, NPTENTRIES - PTX(dstva));
+		if ((dpte = pgdir_walk_range(dst, dstva, 1)) == NULL)
+			return -E_NO_MEM;
+		spte = pgdir_walk_range(src, srcva, 0);
+		for (i = 0; i < n; i++, spte++, dpte++) {
+			pte_insert(dst, dpte, dstva, pa2page(PTE_ADDR(*spte)),
+				   perm);
+			srcva += PGSIZE;
+			dstva += PGSIZE;
+		}
+	}
+	return 0;
+}
+
+//
+// Unmap [va, va + npages pages) in 'pgdir', as with page_remove.
+//
+void
+page_remove_range(pde_t *pgdir, void *va, size_t npages)
+{
+	pte_t *pte;
+	size_t i, n;
+
+	for ( ; npages > 0; npages -= n, va += n * PGSIZE) {
+		n = MIN(npages, NPTENTRIES - PTX(va));
+		if ((pte = pgdir_walk(pgdir, va, 0)) == NULL)
+			continue;
+		if (*pte & PTE_PS) {
+			page_remove(pgdir, va);
+			continue;
+		}
+		for (i = 0; i < n; i++, pte++)
+			if (*pte & PTE_P)
+				pte_remove(pgdir, pte, va + i * PGSIZE);
+	}
+}
+
+//
+// Change the permissions of the pages mapped in [va, va + npages pages)
+// of 'pgdir' to 'perm'; unmapped pages are skipped.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if (perm & PTE_W) but a page is read-only
+//
+int
+page_protect_range(pde_t *pgdir, void *va, size_t npages, int perm)
+{
+	pte_t *pte;
+	size_t i, n;
+
+	for ( ; npages > 0; npages -= n) {
+		n = MIN(npages, NPTENTRIES - PTX(va));
+		if ((pte = pgdir_walk(pgdir, va, 0)) == NULL) {
+			va += n * PGSIZE;
+			continue;
+		}
+		if (*pte & PTE_PS) {
+			// Nothing but the PDE to change
+			pte_t spte = *pte;
+			if ((perm & PTE_W) && !(spte & PTE_W))
+				return -E_INVAL;
+			*pte = PTE_ADDR(spte) | perm | PTE_PS | PTE_P;
+			tlb_invalidate(pgdir, va);
+			va += n * PGSIZE;
+			continue;
+		}
+		for (i = 0; i < n; i++, pte++, va += PGSIZE) {
+			if (!(*pte & PTE_P))
+				continue;
+			if ((perm & PTE_W) && !(*pte & PTE_W))
+				return -E_INVAL;
+			*pte = PTE_ADDR(*pte) | perm | PTE_P;
+			tlb_invalidate(pgdir, va);
+		}
+	}
+	return 0;
+}
+
+//
+// Copy the user part of 'parent' into 'child' for fork: pages marked
+// PTE_SHARE are shared with the same permissions, other writable and
+// copy-on-write pages become copy-on-write in both, and read-only pages
+// are shared read-only.  Superpages are treated the same way, whole.
+// The child gets a fresh user exception stack.  The caller holds the lock
+// of the env owning 'parent'; nobody else may use 'child' yet.  This
+// flushes the parent's TLB entries.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table or the exception stack couldn't be
+//	allocated.  The child may then hold some of the mappings.
+//
+int
+pgdir_fork(pde_t *child, pde_t *parent)
+{
+	struct PageInfo *xstack;
+	pte_t *ppt, *cpt;
+	pte_t pte;
+	uintptr_t va;
+	int i, r = 0;
+
+	for (va = 0; va < UTOP; va += PTSIZE) {
+		if (!(parent[PDX(va)] & PTE_P))
+			continue;
+		if (parent[PDX(va)] & PTE_PS) {
+			pte = parent[PDX(va)];
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				parent[PDX(va)] = pte;
+			}
+			child[PDX(va)] = pte & ~(PTE_A | PTE_D);
+			page_incref(pa2page(PTE_ADDR(pte)));
+			continue;
+		}
+		ppt = (pte_t *) KADDR(PTE_ADDR(parent[PDX(va)]));
+		if ((cpt = pgdir_walk(child, (void *) va, 1)) == NULL) {
+			r = -E_NO_MEM;
+			break;
+		}
+
+		for (i = 0; i < NPTENTRIES; i++) {
+			pte = ppt[i];
+			if (!(pte & PTE_P) ||
+			    va + i * PGSIZE == UXSTACKTOP - PGSIZE)
+				continue;
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				ppt[i] = pte;
+			}
+			cpt[i] = pte & ~(PTE_A | PTE_D);
+			page_incref(pa2page(PTE_ADDR(pte)));
+		}
+	}
+
+	tlb_invalidate_all(parent);
+	if (r < 0)
+		return r;
+
+	if (page_lookup(parent, (void *) (UXSTACKTOP - PGSIZE), NULL)) {
+		if ((xstack = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+		if (page_insert(child, xstack, (void *) (UXSTACKTOP - PGSIZE),
+				PTE_U | PTE_W) < 0) {
+			page_free(xstack);
+			return -E_NO_MEM;
+		}
+	}
+	return 0;
+}
+
+//
+// page_cow for the copy-on-write superpage at 'va', whose PDE is 'pde'.
+//
+static int
+superpage_cow(pde_t *pgdir, void *va, pde_t *pde)
+{
+	struct PageInfo *pp, *copy;
+	int perm;
+
+	pp = pa2page(PTE_ADDR(*pde));
+	perm = (*pde & PTE_SYSCALL & ~PTE_COW) | PTE_W | PTE_PS;
+
+	if (pp->pp_ref == 1) {
+		*pde = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if ((copy = page_alloc_order(SUPERPAGE_ORDER, 0)) == NULL)
+		return -E_NO_MEM;
+	memcpy(page2kva(copy), page2kva(pp), PTSIZE);
+	copy->pp_ref = 1;
+	*pde = page2pa(copy) | perm;
+	tlb_invalidate(pgdir, va);
+	superpage_decref(pp);
+	return 0;
+}
+
+//
+// Handle a write to the copy-on-write page at 'va' in 'pgdir', whose
+// owner's lock the caller holds: give it a private writable copy, or, if
+// nobody else maps the page anymore, just make it writable.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if there is no copy-on-write page at 'va'
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+page_cow(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((pp = page_lookup(pgdir, va, &pte)) == NULL ||
+	    (*pte & (PTE_U | PTE_COW)) != (PTE_U | PTE_COW))
+		return -E_INVAL;
+	if (*pte & PTE_PS)
+		return superpage_cow(pgdir, ROUNDDOWN(va, PTSIZE), pte);
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	// Only the owner of pgdir can add mappings of pp, so if we hold the
+	// only reference, nobody can share it with us anymore.
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if ((copy = page_alloc(0)) == NULL)
+		return -E_NO_MEM;
+	memcpy(page2kva(copy), page2kva(pp), PGSIZE);
+	if (page_insert(pgdir, copy, va, perm) < 0) {
+		page_free(copy);
+		return -E_NO_MEM;
+	}
+	return 0;
 }
 
+//
+// Free 'pgdir' along with all of its user page tables, dropping every page
+// they map.  The address space must be dead: no CPU may be running in it.
+// Since nothing uses the mappings anymore, the pages are dropped straight
+// from the page tables, with no lookups and no per-page TLB flushes.
+//
+void
+pgdir_free(pde_t *pgdir)
+{
+	pte_t *pt;
+	pde_t pde;
+	uint32_t pdeno, pteno;
+
+	static_assert(UTOP % PTSIZE == 0);
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!((pde = pgdir[pdeno]) & PTE_P))
+			continue;
+		if (pde & PTE_PS) {
+			superpage_decref(pa2page(PTE_ADDR(pde)));
+			continue;
+		}
+		pt = (pte_t *) KADDR(PTE_ADDR(pde));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+			if (pt[pteno] & PTE_P)
+				page_decref(pa2page(PTE_ADDR(pt[pteno])));
+		page_decref(pa2page(PTE_ADDR(pde)));
+	}
+
+	// A CPU that still has pgdir loaded must not skip the flush if the
+	// page comes back as somebody else's page directory.
+	tlb_invalidate_all(pgdir);
+	page_decref(pa2page(PADDR(pgdir)));
+}
+
+//
+// Hand the dead address space 'pgdir' to pgdir_free, now or, if few are
+// waiting, when some CPU is idle.
+//
+void
+pgdir_release(pde_t *pgdir)
+{
+	struct PageInfo *pp = pa2page(PADDR(pgdir));
+
+	if (nreap >= REAP_MAX) {
+		pgdir_free(pgdir);
+		return;
+	}
+	spin_lock(&reap_lock);
+	pp->pp_link = reap_list;
+	reap_list = pp;
+	nreap++;
+	spin_unlock(&reap_lock);
+}
+
+//
+// Free one address space left by pgdir_release, or all of them.  Returns
+// whether there was any.
+//
+bool
+pgdir_reap(bool all)
+{
+	struct PageInfo *pp;
+	bool reaped = false;
+
+	do {
+		if (nreap == 0)
+			break;
+		spin_lock(&reap_lock);
+		if ((pp = reap_list) != NULL) {
+			reap_list = pp->pp_link;
+			nreap--;
+		}
+		spin_unlock(&reap_lock);
+		if (pp == NULL)
+			break;
+
+		pp->pp_link = NULL;
+		pgdir_free(page2kva(pp));
+		reaped = true;
+	} while (all);
+	return reaped;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -680,8 +1557,40 @@ void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	// Otherwise, whoever loads pgdir next must not skip the flush.
+	if (rcr3() == PADDR(pgdir))
 		invlpg(va);
+	else
+		__sync_fetch_and_add(&tlb_gen, 1);
+}
+
+//
+// Like tlb_invalidate, for all of the user part of 'pgdir'.
+//
+void
+tlb_invalidate_all(pde_t *pgdir)
+{
+	if (rcr3() == PADDR(pgdir))
+		lcr3(PADDR(pgdir));
+	else
+		__sync_fetch_and_add(&tlb_gen, 1);
+}
+
+//
+// Switch this CPU to the page directory 'pgdir'.  This flushes the
+// non-global TLB entries, unless 'pgdir' is loaded already and no page
+// tables have changed behind our back since then.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	uint32_t gen = tlb_gen;
+
+	if (rcr3() == PADDR(pgdir) && thiscpu->cpu_tlb_gen == gen)
+		return;
+	// Read tlb_gen before the flush, so no change since then is lost.
+	thiscpu->cpu_tlb_gen = gen;
+	lcr3(PADDR(pgdir));
 }
 
 //
@@ -718,7 +1627,8 @@ mmio_map_region(physaddr_t pa, size_t size)
 	if (base + size > MMIOLIM)
 		panic("mmio_map_region: MMIOLIM overflow");
 
-	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W);
+	boot_map_region(kern_pgdir, base, size, pa,
+			PTE_PCD | PTE_PWT | PTE_W | PTE_G);
 
 	ret = (void *) base;
 	base += size;
@@ -780,6 +1690,8 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// The caller must hold env's lock, so that the mapping can't change
+// under it before it is done with the memory; env_destroy() drops it.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
@@ -797,66 +1709,53 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the blocks on the page_free_lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *block;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int order;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		// This keeps the same number of elements in the list,
-		// but it makes page_free_list point to lower addresses first
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	for (order = 0; order <= MAX_ORDER && !page_free_lists[order]; order++)
+		;
+	if (order > MAX_ORDER)
+		panic("'page_free_lists' are all empty!");
 
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	// REMOVED because it would write to literally all the pages
-	// (i.e. when only_low_memory == 1, all pages are < pdx_limit)
-	/*
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
-	*/
+	// entry_pgdir does not map all pages, so the first block page_alloc
+	// splits must be in low memory.
+	assert(PDX(page2pa(page_free_lists[order])) < pdx_limit);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (order = 0; order <= MAX_ORDER; order++)
+	for (block = page_free_lists[order]; block; block = block->pp_link) {
+		// check that we didn't corrupt the free lists themselves
+		assert(block >= pages);
+		assert(block + (1 << order) <= pages + npages);
+		assert(((char *) block - (char *) pages) % sizeof(*block) == 0);
+		assert((block - pages) % (1 << order) == 0);
+		assert(block->pp_order == order);
+		assert(!block->pp_link || block->pp_link->pp_prev == block);
+
+		for (pp = block; pp < block + (1 << order); pp++) {
+			// check a few pages that shouldn't be on the free list
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+			// (new test for lab 4)
+			assert(page2pa(pp) != MPENTRY_PADDR);
+			assert(pp == block || pp->pp_order == PP_ORDER_NONE);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -865,18 +1764,79 @@ check_page_free_list(bool only_low_memory)
 	cprintf("check_page_free_list() succeeded!\n");
 }
 
+// For the checks: take every free block off the free lists and onto
+// 'saved', where page_free won't merge with them.  This CPU's page cache
+// goes too.
+static void
+check_steal_free_lists(struct PageInfo **saved)
+{
+	struct PageInfo *pp;
+	int order;
+
+	page_cache_drain(&page_caches[cpunum()], PAGE_CACHE_SIZE);
+	for (order = 0; order <= MAX_ORDER; order++) {
+		saved[order] = NULL;
+		while ((pp = page_free_lists[order]) != NULL) {
+			buddy_remove(pp);
+			pp->pp_link = saved[order];
+			saved[order] = pp;
+		}
+	}
+}
+
+// Give back the blocks taken by check_steal_free_lists.
+static void
+check_return_free_lists(struct PageInfo **saved)
+{
+	struct PageInfo *pp;
+	int order;
+
+	for (order = 0; order <= MAX_ORDER; order++) {
+		while ((pp = saved[order]) != NULL) {
+			saved[order] = pp->pp_link;
+			pp->pp_link = NULL;
+			buddy_insert(pp - pages, order);
+		}
+	}
+}
+
 int
 num_free_pages(void)
 {
-	struct PageInfo *p;
-	int num;
+	int num, order, i;
+
+	spin_lock(&page_lock);
+	for (num = 0, order = 0; order <= MAX_ORDER; order++)
+		num += order_stats[order].free << order;
+	spin_unlock(&page_lock);
+	for (i = 0; i < NCPU; i++)
+		num += page_caches[i].pc_count;
+	num += nzero_pages;
+
+	return num;
+}
+
+int
+num_alloced_pages(void)
+{
+	int num, i;
 
-	for (num = 0, p = page_free_list; p; p = p->pp_link)
-		num++;
+	spin_lock(&page_lock);
+	num = num_page_alloced;
+	spin_unlock(&page_lock);
+	for (i = 0; i < NCPU; i++)
+		num -= page_caches[i].pc_count;
+	num -= nzero_pages;
 
 	return num;
 }
 
+int
+num_zeroed_pages(void)
+{
+	return nzero_pages;
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -885,8 +1845,9 @@ static void
 check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
+	struct PageCache *pc;
 	int nfree;
-	struct PageInfo *fl;
+	struct PageInfo *fl[MAX_ORDER + 1];
 	char *c;
 	int i;
 
@@ -894,8 +1855,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = num_free_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -911,8 +1871,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free_lists(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -939,8 +1898,17 @@ check_page_alloc(void)
 	for (i = 0; i < PGSIZE; i++)
 		assert(c[i] == 0);
 
+	// a page in another CPU's cache should be taken back once the free
+	// lists are empty
+	pc = &page_caches[(cpunum() + 1) % NCPU];
+	pp0->pp_order = PP_ORDER_CACHED;
+	pc->pc_pages[pc->pc_count++] = pp0;
+	assert(page_alloc(0) == pp0);
+	assert(pc->pc_count == 0);
+	assert(!page_alloc(0));
+
 	// give free list back
-	page_free_list = fl;
+	check_return_free_lists(fl);
 
 	// free the pages we took
 	page_free(pp2);
@@ -948,9 +1916,16 @@ check_page_alloc(void)
 	page_free(pp0);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == num_free_pages());
+
+	// should be able to allocate a block of each order, aligned to its
+	// size, and get it back together when it's freed
+	for (i = 0; i <= MAX_ORDER; i++) {
+		assert((pp = page_alloc_order(i, 0)));
+		assert((pp - pages) % (1 << i) == 0);
+		page_free_order(pp, i);
+		assert(nfree == num_free_pages());
+	}
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -976,10 +1951,10 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
-	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
-		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	// check envs array (new test for lab 3): nothing there until
+	// env_init grows it
+	assert(check_va2pa(pgdir, UENVS) == ~0);
+	assert(check_va2pa(pgdir, KENVS) == ~0);
 
 	// check phys mem
 	i = 0;
@@ -1043,7 +2018,7 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	if (!(*pgdir & PTE_P))
 		return ~0;
 	if (*pgdir & PTE_PS)
-		return PTE_ADDR(*pgdir);
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1056,7 +2031,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct PageInfo *fl[MAX_ORDER + 1];
 	pte_t *ptep, *ptep1;
 	void *va;
 	uintptr_t mm1, mm2;
@@ -1074,8 +2049,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free_lists(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1195,7 +2169,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_lists(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -14,7 +14,6 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
-extern size_t num_page_alloced;
 
 extern pde_t *kern_pgdir;
 
@@ -52,17 +51,55 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Free physical memory is kept in blocks of 2^order contiguous pages,
+// aligned to their size, for orders up to MAX_ORDER (4MB).
+#define MAX_ORDER	10
+
+// A 4MB superpage is a block of this order, mapped by a single PDE with
+// PTE_PS set.  Its reference count lives in the first page of the block.
+#define SUPERPAGE_ORDER	(PTSHIFT - PGSHIFT)
+
+// Buddy allocator statistics, per order.
+struct PageOrderStats {
+	size_t free;		// Free blocks of this order
+	uint64_t allocs;	// Blocks of this order allocated
+	uint64_t frees;		// Blocks of this order freed
+	uint64_t splits;	// Blocks of this order split in two
+	uint64_t merges;	// Blocks of this order made from two buddies
+};
+
 void	mem_init(void);
+void	mem_init_percpu(void);
+bool	superpages_avail(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+bool	page_is_free(struct PageInfo *pp);
+void	page_order_stats(struct PageOrderStats *stats);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_super(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+int	page_alloc_range(pde_t *pgdir, void *va, size_t npages, int perm);
+int	page_map_range(pde_t *dst, void *dstva, pde_t *src, void *srcva,
+		       size_t npages, int perm);
+void	page_remove_range(pde_t *pgdir, void *va, size_t npages);
+int	page_protect_range(pde_t *pgdir, void *va, size_t npages, int perm);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+int	pgdir_fork(pde_t *child, pde_t *parent);
+int	page_cow(pde_t *pgdir, void *va);
+void	pgdir_free(pde_t *pgdir);
+void	pgdir_release(pde_t *pgdir);
+bool	pgdir_reap(bool all);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_invalidate_all(pde_t *pgdir);
+void	pgdir_load(pde_t *pgdir);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -70,6 +107,8 @@ int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
 int num_free_pages(void);
+int num_alloced_pages(void);
+int num_zeroed_pages(void);
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
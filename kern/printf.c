@@ -4,6 +4,12 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/spinlock.h>
+
+// Keeps lines printed by different CPUs from being interleaved.
+static struct spinlock cprintf_lock = {
+	.name = "cprintf_lock"
+};
 
 static char *log_levels[] = {
 	"DEBUG",
@@ -22,8 +28,18 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	extern const char *panicstr;
+
+	// Once somebody has panicked, don't risk deadlocking on the lock:
+	// the panicking CPU may already hold it.  Just print.
+	if (panicstr) {
+		vprintfmt((void*)putch, &cnt, fmt, ap);
+		return cnt;
+	}
 
+	spin_lock(&cprintf_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	spin_unlock(&cprintf_lock);
 	return cnt;
 }
 
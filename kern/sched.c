@@ -4,87 +4,471 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/pagemerge.h>
+#include <kern/sysinfo.h>
 
-void sched_halt(void);
+// Multi-level feedback queue.  There are ENV_NPRIO priority levels, 0
+// being the highest, and we always run the highest priority env we can.
+// An env that uses up its whole time slice is CPU-bound and moves down a
+// level, where slices are longer.  An env that blocks in sys_ipc_recv
+// goes back up to its base priority, so servers and interactive envs stay
+// ahead of the spinners.  Every SCHED_BOOST_TICKS, queued envs are also
+// boosted back to their base priority so that none of them starves.
+//
+// Timer ticks are one-shot: a CPU only gets one when it has envs queued,
+// which may have to preempt the one it runs.  A CPU running a single env
+// runs it undisturbed, and a halted CPU sleeps until it is sent work.
+// Time slices and boosts only count the ticks a CPU does get.
+#define SCHED_SLICE(prio)	(1 << (prio))	// In timer ticks
+#define SCHED_BOOST_TICKS	100
+
+// Per-CPU queues of ENV_RUNNABLE environments, one per priority level,
+// linked through Env->env_rq_next and Env->env_rq_prev.  An environment is
+// on a run queue if and only if its status is ENV_RUNNABLE, and then it is
+// on the level given by its env_priority.  runqueues[i] belongs to
+// cpus[i], whose cpu_load is the number of envs queued on all levels.
+//
+// rq_lock protects the links and cpu_load, as well as env_priority and
+// env_slice of queued envs.  Which queue an env is on (env_rq) only
+// changes under that env's lock, which is taken first.
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head[ENV_NPRIO];
+	struct Env *rq_tail[ENV_NPRIO];
+	unsigned rq_ticks;		// Timer ticks seen by this CPU
+	bool rq_timer;			// This CPU's timer is counting down
+};
+
+static struct RunQueue runqueues[NCPU];
+
+#define RQ_CPU(rq)	(&cpus[(rq) - runqueues])
+
+// An env on a run queue may still be in use by the CPU that last ran it,
+// until that CPU has switched away from it (see env_release).
+#define ENV_BUSY(e)	((e)->env_cpu != NULL && (e)->env_cpu != thiscpu)
+
+// Serializes the "is everybody idle?" check in sched_halt().
+static struct spinlock halt_lock = {
+	.name = "halt_lock"
+};
+static bool in_monitor;
+
+void sched_halt(void) __attribute__((noreturn));
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&runqueues[i].rq_lock, "rq_lock");
+}
+
+// Kick one halted CPU (other than ours) so that it comes and steals the
+// work we just queued.  Halted CPUs get no timer ticks, so it would
+// otherwise sleep on.
+static void
+sched_wakeup_idle(void)
+{
+	int i;
+	int me = cpunum();
+
+	// Make our cpu_load visible before we look at who is halted; see
+	// sched_halt().
+	asm volatile("lock; addl $0,0(%%esp)" : : : "memory");
+	for (i = 0; i < ncpu; i++) {
+		if (i != me && cpus[i].cpu_status == CPU_HALTED) {
+			lapic_ipi_cpu(cpus[i].cpu_id, T_IPI_WAKEUP);
+			return;
+		}
+	}
+}
+
+// Append 'e' to the level of 'rq' given by its priority.
+// The caller must hold rq_lock.
+static void
+rq_append(struct RunQueue *rq, struct Env *e)
+{
+	int prio = e->env_priority;
+
+	e->env_rq = rq;
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[prio];
+	if (rq->rq_tail[prio])
+		rq->rq_tail[prio]->env_rq_next = e;
+	else
+		rq->rq_head[prio] = e;
+	rq->rq_tail[prio] = e;
+	RQ_CPU(rq)->cpu_load++;
+	sysinfo->si_cpus[rq - runqueues].sc_load = RQ_CPU(rq)->cpu_load;
+}
+
+// Unlink 'e' from its level of 'rq'.  The caller must hold rq_lock.
+static void
+rq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	int prio = e->env_priority;
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head[prio] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail[prio] = e->env_rq_prev;
+	RQ_CPU(rq)->cpu_load--;
+	sysinfo->si_cpus[rq - runqueues].sc_load = RQ_CPU(rq)->cpu_load;
+
+	e->env_rq = NULL;
+	e->env_rq_next = e->env_rq_prev = NULL;
+}
+
+// Have a timer tick come within a tick's time on this CPU, whose run
+// queue is 'rq', if one isn't already on its way.
+static void
+sched_timer_start(struct RunQueue *rq)
+{
+	if (!rq->rq_timer) {
+		rq->rq_timer = true;
+		lapic_timer_start();
+	}
+}
+
+// Mark 'e' runnable and append it to the current CPU's run queue.
+// The caller must hold e's lock.
+void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+
+	assert(e->env_rq == NULL);
+
+	e->env_status = ENV_RUNNABLE;
+	spin_lock(&rq->rq_lock);
+	rq_append(rq, e);
+	spin_unlock(&rq->rq_lock);
+
+	sched_timer_start(rq);
+	sched_wakeup_idle();
+}
+
+// Remove 'e' from whichever run queue it is on, if any.
+// Does not change e's status; the caller is about to.
+// The caller must hold e's lock.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq = e->env_rq;
+
+	if (rq == NULL)
+		return;
+
+	spin_lock(&rq->rq_lock);
+	rq_unlink(rq, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Move 'e' to priority level 'prio' with a fresh time slice, requeueing
+// it if it is queued.  The caller must hold e's lock.
+void
+sched_set_priority(struct Env *e, int prio)
+{
+	assert(prio >= 0 && prio < ENV_NPRIO);
+
+	if (e->env_rq) {
+		sched_dequeue(e);
+		e->env_priority = prio;
+		e->env_slice = SCHED_SLICE(prio);
+		sched_enqueue(e);
+	} else {
+		e->env_priority = prio;
+		e->env_slice = SCHED_SLICE(prio);
+	}
+}
+
+// Boost every env queued on 'rq' back to its base priority.
+static void
+sched_boost(struct RunQueue *rq)
+{
+	int prio;
+	struct Env *e, *next;
+
+	spin_lock(&rq->rq_lock);
+	for (prio = 1; prio < ENV_NPRIO; prio++) {
+		for (e = rq->rq_head[prio]; e; e = next) {
+			next = e->env_rq_next;
+			if (e->env_base_priority >= prio)
+				continue;
+			rq_unlink(rq, e);
+			e->env_priority = e->env_base_priority;
+			e->env_slice = SCHED_SLICE(e->env_priority);
+			rq_append(rq, e);
+		}
+	}
+	spin_unlock(&rq->rq_lock);
+}
+
+// Is an env of higher priority than 'prio' waiting on our run queue?
+// Only a hint: we don't take the lock.
+static bool
+sched_higher_waiting(int prio)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+	int i;
+
+	for (i = 0; i < prio; i++)
+		if (rq->rq_head[i])
+			return true;
+	return false;
+}
+
+static struct Env *sched_pick(int maxprio);
+
+// Called on every timer tick.  Charges the tick to curenv's time slice,
+// demoting it if it used up the whole slice.  Then switches to a higher
+// priority env if one is waiting or, if curenv's slice is over, to one
+// of the same priority.  Otherwise returns, and curenv keeps running.
+void
+sched_tick(void)
+{
+	struct RunQueue *rq = &runqueues[cpunum()];
+	struct Env *e = curenv;
+	struct Env *next_env;
+	bool expired = false;
+
+	// Another tick if anything still waits here.
+	rq->rq_timer = false;
+	if (thiscpu->cpu_load > 0)
+		sched_timer_start(rq);
+
+	if (++rq->rq_ticks % SCHED_BOOST_TICKS == 0)
+		sched_boost(rq);
+	thissysinfo->sc_ticks = rq->rq_ticks;
+
+	if (e == NULL)
+		sched_yield();
+
+	env_lock(e);
+	if (e->env_status == ENV_RUNNING && --e->env_slice <= 0) {
+		if (e->env_priority < ENV_NPRIO - 1)
+			e->env_priority++;
+		e->env_slice = SCHED_SLICE(e->env_priority);
+		expired = true;
+	}
+	env_unlock(e);
+
+	if (e->env_status != ENV_RUNNING)
+		sched_yield();
+
+	if (expired || sched_higher_waiting(e->env_priority)) {
+		next_env = sched_pick(expired ? e->env_priority :
+				      e->env_priority - 1);
+		if (next_env != NULL)
+			env_run(next_env);
+	}
+}
+
+// Return the first env on 'rq' that isn't busy elsewhere, scanning
+// levels from the highest priority down to 'maxprio', and each level from
+// its head (or from its tail if 'from_tail').
+static struct Env *
+rq_first(struct RunQueue *rq, int maxprio, bool from_tail)
+{
+	int prio;
+	struct Env *e = NULL;
+
+	spin_lock(&rq->rq_lock);
+	for (prio = 0; prio <= maxprio && e == NULL; prio++) {
+		if (from_tail)
+			for (e = rq->rq_tail[prio]; e && ENV_BUSY(e);
+			     e = e->env_rq_prev)
+				;
+		else
+			for (e = rq->rq_head[prio]; e && ENV_BUSY(e);
+			     e = e->env_rq_next)
+				;
+	}
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Return a candidate to run next with priority 'maxprio' or better, or
+// NULL if there is none.
+// Take the best env on this CPU's own queue if it has one.  Otherwise
+// steal from the CPU with the highest load; we take the tail of its best
+// level, the env it would get to last, and leave the head to its owner.
+// Envs still in use by another CPU are skipped.
+static struct Env *
+sched_candidate(int maxprio)
+{
+	int i;
+	int busiest = -1;
+	struct Env *e;
+
+	if ((e = rq_first(&runqueues[cpunum()], maxprio, false)) != NULL)
+		return e;
+
+	for (i = 0; i < ncpu; i++) {
+		if (cpus[i].cpu_load > 0 &&
+		    (busiest < 0 || cpus[i].cpu_load > cpus[busiest].cpu_load))
+			busiest = i;
+	}
+	if (busiest < 0)
+		return NULL;
+
+	return rq_first(&runqueues[busiest], maxprio, true);
+}
+
+// Take 'e' off its run queue to run it on this CPU.  Fails if some other
+// CPU got to it first, or it stopped being runnable since we looked.
+static bool
+sched_claim(struct Env *e)
+{
+	bool claimed;
+
+	env_lock(e);
+	claimed = e->env_status == ENV_RUNNABLE && !ENV_BUSY(e);
+	if (claimed) {
+		sched_dequeue(e);
+		e->env_status = ENV_RUNNING;
+		e->env_cpu = thiscpu;
+	}
+	env_unlock(e);
+	return claimed;
+}
+
+// Directed yield: claim 'e', which the caller has locked and is waking up
+// from a blocked state, to run on this CPU next, without going through a
+// run queue.  Fails if the CPU that last ran e hasn't let go of it yet,
+// in which case the caller should sched_enqueue it instead.
+bool
+sched_claim_locked(struct Env *e)
+{
+	assert(e->env_rq == NULL);
+	if (ENV_BUSY(e))
+		return false;
+	e->env_status = ENV_RUNNING;
+	e->env_cpu = thiscpu;
+	return true;
+}
+
+// Return the next runnable environment with priority 'maxprio' or
+// better, claimed for this CPU, or NULL if there is none.  We only retry a
+// few times when we lose a race; if we keep losing, there are other CPUs
+// busy running things anyway.
+static struct Env *
+sched_pick(int maxprio)
+{
+	int tries;
+	struct Env *e;
+
+	for (tries = 0; tries < 4; tries++) {
+		if ((e = sched_candidate(maxprio)) == NULL)
+			return NULL;
+		if (sched_claim(e))
+			return e;
+	}
+	return NULL;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
 	struct Env *next_env;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Round-robin within the highest priority level that has runnable
+	// envs: take the env at the head of that level.  env_run() puts the
+	// env we're preempting (if any) back at the tail of its level.  An
+	// idle CPU steals work from the most loaded one.  Yielding gives the
+	// CPU to envs of any priority; sched_tick() is what enforces them.
 	//
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
 	// choose that environment.
 	//
 	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	next_env = curenv == NULL ? envs : curenv + 1;
-
-	for (idle = next_env; idle < envs + NENV; idle++)
-	{
-		if (idle->env_status == ENV_RUNNABLE)
-			env_run(idle);
+	// another CPU (env_status == ENV_RUNNING); those are never on a
+	// run queue, and envs another CPU hasn't finished switching away
+	// from are skipped. If there are no runnable environments, simply
+	// drop through to the code below to halt the cpu.
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		if ((next_env = sched_pick(ENV_NPRIO - 1)) != NULL)
+			env_run(next_env);
+		env_run(curenv);
 	}
 
-	for (idle = envs; idle < next_env; idle++)
-	{
-		if (idle->env_status == ENV_RUNNABLE)
-			env_run(idle);
+	// curenv blocked or was killed.  Let go of it before looking for
+	// work, so that whoever wakes it up can run it elsewhere right away,
+	// or so that it gets freed if it is dying.
+	if (curenv) {
+		lcr3(PADDR(kern_pgdir));
+		env_release(curenv);
+		curenv = NULL;
 	}
 
-	// If no other environments are runnable, re-run curenv
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
+	if ((next_env = sched_pick(ENV_NPRIO - 1)) != NULL)
+		env_run(next_env);
 
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do. Wait until another CPU
+// sends it work. This function never returns.
 //
 void
 sched_halt(void)
 {
+	struct RunQueue *rq = &runqueues[cpunum()];
 	int i;
 
+	// Mark that no environment is running on this CPU
+	curenv = NULL;
+	thissysinfo->sc_env = 0;
+	lcr3(PADDR(kern_pgdir));
+
+	// Make ourselves useful before halting.
+	pgdir_reap(false);
+	page_merge_idle();
+	page_zero_idle();
+	sysinfo_refresh();
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	// That is the case once every run queue is empty and every CPU is
+	// halted: a CPU that is running an env isn't halted.  Marking
+	// ourselves halted under halt_lock makes sure that the last CPU to
+	// get here sees all the others halted.
+	spin_lock(&halt_lock);
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	for (i = 0; i < ncpu; i++) {
+		if (cpus[i].cpu_load > 0 || cpus[i].cpu_status != CPU_HALTED)
 			break;
 	}
-	if (i == NENV) {
+	if (i == ncpu && !in_monitor) {
+		in_monitor = true;
+		spin_unlock(&halt_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
+	spin_unlock(&halt_lock);
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
-
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
-	xchg(&thiscpu->cpu_status, CPU_HALTED);
-
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Only an IPI from whoever queues work next wakes us up.  If some was
+	// queued before we were marked halted, come back for it on the next
+	// tick instead.  sched_wakeup_idle() looks the other way around.
+	for (i = 0; i < ncpu && cpus[i].cpu_load == 0; i++)
+		;
+	if (i < ncpu) {
+		sched_timer_start(rq);
+	} else {
+		rq->rq_timer = false;
+		lapic_timer_stop();
+	}
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -97,4 +481,5 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("halt loop exited");  /* mostly to placate the compiler */
 }
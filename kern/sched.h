@@ -6,7 +6,17 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+void sched_init(void);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_priority(struct Env *e, int prio);
+bool sched_claim_locked(struct Env *e);
+void sched_tick(void);
+
 #endif	// !JOS_KERN_SCHED_H
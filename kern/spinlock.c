@@ -9,13 +9,6 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,16 +32,53 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
+}
+#endif
+
+#ifdef SPINLOCK_STATS
+struct spinlock *spin_stats_list;
+
+// Protects spin_stats_list.  A bare test-and-set word rather than a
+// spinlock, which would have to list itself.
+static volatile uint32_t spin_stats_list_locked;
+
+// Put lk, which we hold, on spin_stats_list the first time it is taken.
+// This way statically initialized locks show up too.
+static void
+spin_stats_list_add(struct spinlock *lk)
+{
+	while (xchg(&spin_stats_list_locked, 1) != 0)
+		asm volatile ("pause");
+	lk->stats_next = spin_stats_list;
+	spin_stats_list = lk;
+	xchg(&spin_stats_list_locked, 0);
+	lk->stats_listed = true;
+}
+
+// Zero the counters of every lock.  Racy against CPUs using the locks,
+// which is fine for statistics.
+void
+spin_stats_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = spin_stats_list; lk; lk = lk->stats_next) {
+		lk->acquisitions = 0;
+		lk->contended = 0;
+		lk->spin_cycles = 0;
+		lk->max_hold = 0;
+	}
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = 0;
+	lk->owner = 0;
 	lk->name = name;
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
 }
@@ -60,16 +90,41 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+#ifdef SPINLOCK_STATS
+	uint64_t spin_start = 0;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// The xadd is atomic, so every CPU gets a different ticket.  It also
+	// serializes, so that reads after acquire are not reordered before
+	// it.  Waiters only read 'owner', which the holder writes once, on
+	// release.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef SPINLOCK_STATS
+		spin_start = read_tsc();
+#endif
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+	}
+	// Keep gcc from hoisting the critical section above the wait.
+	asm volatile("" : : : "memory");
+
+#ifdef SPINLOCK_STATS
+	lk->hold_start = read_tsc();
+	lk->acquisitions++;
+	if (spin_start) {
+		lk->contended++;
+		lk->spin_cycles += lk->hold_start - spin_start;
+	}
+	if (!lk->stats_listed)
+		spin_stats_list_add(lk);
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -82,6 +137,10 @@ spin_lock(struct spinlock *lk)
 void
 spin_unlock(struct spinlock *lk)
 {
+#ifdef SPINLOCK_STATS
+	uint64_t hold;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
 		int i;
@@ -107,10 +166,17 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
-	// respect to any other instruction which references the same memory.
-	// x86 CPUs will not reorder loads/stores across locked instructions
-	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
-	// gcc will not reorder C statements across the xchg.
-	xchg(&lk->locked, 0);
+#ifdef SPINLOCK_STATS
+	hold = read_tsc() - lk->hold_start;
+	if (hold > lk->max_hold)
+		lk->max_hold = hold;
+#endif
+
+	// Only the holder writes 'owner', so a plain increment will do.
+	// x86 CPUs don't reorder stores with older loads or stores (vol 3,
+	// 8.2.2), so everything we did while holding the lock is visible
+	// before the next CPU sees its ticket come up.  The barrier keeps
+	// gcc from moving our accesses past the release.
+	asm volatile("" : : : "memory");
+	lk->owner++;
 }
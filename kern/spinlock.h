@@ -6,17 +6,36 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
-// Mutual exclusion lock.
+// Uncomment this to enable spinlock contention statistics.  They cost two
+// rdtsc's on every lock and unlock.
+//#define SPINLOCK_STATS
+
+// Mutual exclusion lock.  A ticket lock: each CPU that wants the lock
+// takes the next ticket and waits for 'owner' to reach it, so waiters
+// get the lock in the order they arrived.  An all-zero spinlock is a
+// valid, unlocked lock.
 struct spinlock {
-	unsigned locked;       // is the lock held?
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket currently holding the lock
+	char *name;		// Name of lock.
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
+
+#ifdef SPINLOCK_STATS
+	// Only updated by the holder, so they need no atomic operations.
+	uint64_t acquisitions;	// Number of times the lock was taken
+	uint64_t contended;	// ... of which we had to wait for it
+	uint64_t spin_cycles;	// Total TSC cycles spent waiting
+	uint64_t max_hold;	// Longest TSC cycles between lock and unlock
+	uint64_t hold_start;	// TSC when the current holder got it
+	struct spinlock *stats_next;	// Next lock in spin_stats_list
+	bool stats_listed;	// Is the lock on spin_stats_list yet?
+#endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
@@ -25,24 +44,11 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#ifdef SPINLOCK_STATS
+// Every lock that has been taken at least once, most recent first.
+extern struct spinlock *spin_stats_list;
+
+void spin_stats_reset(void);
+#endif
 
 #endif
@@ -11,6 +11,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/ipc.h>
+#include <kern/fpu.h>
 
 #define ALIGNED_USER_ADDR(va) ((uintptr_t)va % PGSIZE == 0 ||	\
                                (uintptr_t)va < UTOP)
@@ -18,6 +20,11 @@
 #define VALID_USER_PERM(perm) (!(perm & ~PTE_SYSCALL) &&		\
 			       ((perm & PTE_U) || (perm & PTE_P)))
 
+// [va, va + npages pages) is a page-aligned range below UTOP.
+#define VALID_USER_RANGE(va, npages) ((uintptr_t) (va) % PGSIZE == 0 &&	\
+				      (uintptr_t) (va) < UTOP &&		\
+				      (npages) <= (UTOP - (uintptr_t) (va)) / PGSIZE)
+
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -27,10 +34,12 @@ sys_cputs(const char *s, size_t len)
 {
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
+	env_lock(curenv);
 	user_mem_assert(curenv, s, len, 0);
 
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	env_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -59,7 +68,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
 	env_destroy(e);
 	return 0;
@@ -92,18 +101,68 @@ sys_exofork(void)
 	if (err != 0)
 		return err;
 
-	new_env->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc leaves new_env ENV_NOT_RUNNABLE, so nobody else will
+	// touch it until we make it runnable.
+
+	// The child inherits our base priority, and whether its pages may
+	// be merged.
+	env_lock(new_env);
+	new_env->env_base_priority = curenv->env_base_priority;
+	new_env->env_merge = curenv->env_merge;
+	sched_set_priority(new_env, new_env->env_base_priority);
+	env_unlock(new_env);
 
 	// Copy registers from parent, except for eax (return value of system
 	// call)
 	new_env->env_tf = curenv->env_tf;
 	new_env->env_tf.tf_regs.reg_eax = 0;
 
+	// And our FPU state.
+	if ((err = fpu_fork(new_env, curenv)) < 0) {
+		env_lock(new_env);
+		env_destroy(new_env);
+		return err;
+	}
+
 	// Current environment sees the new env_id as the return value, while
 	// the child sees 0.
 	return new_env->env_id;
 }
 
+// Create a runnable copy of the current environment, whose writable
+// pages are shared copy-on-write between the two; the page fault handler
+// copies them when either one writes.  The child inherits our page fault
+// upcall, and gets a fresh user exception stack if we have one.
+// Returns envid of the child to the parent, 0 to the child, or < 0 on
+// error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *child;
+	envid_t envid;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	child = &envs[ENVX(envid)];
+
+	env_lock(curenv);
+	r = pgdir_fork(child->env_pgdir, curenv->env_pgdir);
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env_unlock(curenv);
+
+	env_lock(child);
+	if (r < 0) {
+		env_destroy(child);
+		return r;
+	}
+	sched_enqueue(child);
+	env_unlock(child);
+	return envid;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -126,10 +185,21 @@ sys_env_set_status(envid_t envid, int status)
 	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
 		return -E_INVAL;
 
-	if ((err = envid2env(envid, &env, 1)) != 0)
+	if ((err = envid2env_lock(envid, &env, 1)) != 0)
 		return err;
 
-	env->env_status = status;
+	// Only a transition into ENV_RUNNABLE queues the env; an env that is
+	// already runnable or running is left alone, and so is one blocked in
+	// sys_ipc_send, which wakes up when its send completes.
+	if (status == ENV_RUNNABLE) {
+		if (env->env_status == ENV_NOT_RUNNABLE &&
+		    !env->env_ipc_sending)
+			sched_enqueue(env);
+	} else if (env->env_status != ENV_DYING) {
+		sched_dequeue(env);
+		env->env_status = status;
+	}
+	env_unlock(env);
 	return 0;
 }
 
@@ -149,16 +219,19 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// LAB 5: Your code here.
 	// Remember to check whether the user has supplied us with a good
 	// address!
-	if ((r = envid2env(envid, &env, 1)) < 0)
+	if ((r = envid2env_lock(envid, &env, 1)) < 0)
 		return r;
 
-	if ((r = user_mem_check(env, tf, sizeof(*tf), PTE_U)) < 0)
+	if ((r = user_mem_check(env, tf, sizeof(*tf), PTE_U)) < 0) {
+		env_unlock(env);
 		return r;
+	}
 
 	env->env_tf = *tf;
 	env->env_tf.tf_cs |= 3;          // Ensure CPL 3
 	env->env_tf.tf_eflags |= FL_IF;  // Ensure interrupts enabled
 
+	env_unlock(env);
 	return 0;
 }
 
@@ -177,7 +250,7 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	struct Env *env;
 
-	if (envid2env(envid, &env, 1) != 0)
+	if (envid2env_lock(envid, &env, 1) != 0)
 		return -E_BAD_ENV;
 
 	// Grade script doesn't like it
@@ -188,10 +261,41 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 */
 
 	env->env_pgfault_upcall = func;
+	env_unlock(env);
 
 	return 0;
 }
 
+// sys_page_alloc for a superpage.
+static int
+sys_superpage_alloc(envid_t envid, void *va, int perm)
+{
+	struct Env *env;
+	struct PageInfo *page;
+	int r;
+
+	if (!superpages_avail() || (uintptr_t) va % PTSIZE != 0 ||
+	    (uintptr_t) va >= UTOP - PTSIZE)
+		return -E_INVAL;
+
+	if (!VALID_USER_PERM(perm))
+		return -E_INVAL;
+
+	if ((page = page_alloc_order(SUPERPAGE_ORDER, ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+
+	if (envid2env_lock(envid, &env, 1) != 0) {
+		page_free_order(page, SUPERPAGE_ORDER);
+		return -E_BAD_ENV;
+	}
+
+	r = page_insert_super(env->env_pgdir, page, va, perm);
+	env_unlock(env);
+	if (r < 0)
+		page_free_order(page, SUPERPAGE_ORDER);
+	return r;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -200,12 +304,20 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS may be added to allocate a 4MB superpage instead, mapped
+//         at the 4MB-aligned 'va' in place of everything in
+//         [va, va+PTSIZE).  A superpage can't be mapped elsewhere with
+//         sys_page_map or sent over IPC, and unmapping any page of it
+//         unmaps it all.  The top 4MB below UTOP, which holds the user
+//         stacks, can't be a superpage.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if perm has PTE_PS but the CPU has no 4MB pages, or va
+//		isn't 4MB-aligned or is in the top 4MB below UTOP.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -215,6 +327,9 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	struct Env *env;
 	struct PageInfo *page;
 
+	if (perm & PTE_PS)
+		return sys_superpage_alloc(envid, va, perm & ~PTE_PS);
+
 	// Hint: This function is a wrapper around page_alloc() and
 	//   page_insert() from kern/pmap.c.
 	//   Most of the new code you write should be to check the
@@ -223,29 +338,33 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	//   allocated!
 
 	// LAB 4: Your code here.
-	// 1. Ensure envid is valid and that current environment can manipulate
-	// the environment.
-	if (envid2env(envid, &env, 1) != 0)
-		return -E_BAD_ENV;
-
-	// 2. Ensure valid address
+	// 1. Ensure valid address
 	if (!ALIGNED_USER_ADDR(va))
 		return -E_INVAL;
 
-	// 3. Ensure valid permissions
+	// 2. Ensure valid permissions
 	if (!VALID_USER_PERM(perm))
 		return -E_INVAL;
 
-	// 4. Allocate page and insert into address space
+	// 3. Allocate page, outside of any env lock
 	if((page = page_alloc(ALLOC_ZERO)) == NULL)
 		return -E_NO_MEM;
 
+	// 4. Ensure envid is valid and that current environment can
+	// manipulate the environment, then insert into its address space.
+	if (envid2env_lock(envid, &env, 1) != 0) {
+		page_free(page);
+		return -E_BAD_ENV;
+	}
+
 	if (page_insert(env->env_pgdir, page, va, perm) != 0)
 	{
+		env_unlock(env);
 		page_free(page);
 		return -E_NO_MEM;
 	}
 
+	env_unlock(env);
 	return 0;
 }
 
@@ -260,7 +379,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		or the caller doesn't have permission to change one of them.
 //	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
 //		or dstva >= UTOP or dstva is not page-aligned.
-//	-E_INVAL is srcva is not mapped in srcenvid's address space.
+//	-E_INVAL is srcva is not mapped in srcenvid's address space,
+//		or is in a superpage.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
@@ -273,10 +393,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	struct Env *dstenv;
 	pte_t *page_pte;
 	struct PageInfo *page;
-
-	if (envid2env(srcenvid, &srcenv, 1) != 0 ||
-	    envid2env(dstenvid, &dstenv, 1) != 0)
-		return -E_BAD_ENV;
+	int r;
 
 	if (!ALIGNED_USER_ADDR(srcva) || !ALIGNED_USER_ADDR(dstva))
 		return -E_INVAL;
@@ -284,17 +401,24 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if (!VALID_USER_PERM(perm))
 		return -E_INVAL;
 
-	if ((page = page_lookup(srcenv->env_pgdir, srcva, &page_pte)) == NULL)
-		return -E_INVAL;
+	if (envid2env_lock_pair(srcenvid, &srcenv, dstenvid, &dstenv, 1) != 0)
+		return -E_BAD_ENV;
 
+	if ((page = page_lookup(srcenv->env_pgdir, srcva, &page_pte)) == NULL)
+		r = -E_INVAL;
+	// Only a superpage's first page has a reference count
+	else if (*page_pte & PTE_PS)
+		r = -E_INVAL;
 	// Make sure that if the page was RO, we can't map it with write perm
-	if ((perm & PTE_W) && !(*page_pte & PTE_W))
-		return -E_INVAL;
-
-	if (page_insert(dstenv->env_pgdir, page, dstva, perm) != 0)
-		return -E_NO_MEM;
+	else if ((perm & PTE_W) && !(*page_pte & PTE_W))
+		r = -E_INVAL;
+	else if (page_insert(dstenv->env_pgdir, page, dstva, perm) != 0)
+		r = -E_NO_MEM;
+	else
+		r = 0;
 
-	return 0;
+	env_unlock_pair(srcenv, dstenv);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -309,20 +433,114 @@ sys_page_unmap(envid_t envid, void *va)
 {
 	struct Env *env;
 
-	if (envid2env(envid, &env, 1) != 0)
-		return -E_BAD_ENV;
-
 	if (!ALIGNED_USER_ADDR(va))
 		return -E_INVAL;
 
+	if (envid2env_lock(envid, &env, 1) != 0)
+		return -E_BAD_ENV;
+
 	page_remove(env->env_pgdir, va);
+	env_unlock(env);
 
 	return 0;
 }
 
+// The range versions of the calls above act on the 'npages' pages from
+// 'va', in one system call.  They return the same errors, plus -E_INVAL
+// if the range doesn't fit below UTOP.  If one fails, it may have done
+// some of the pages already.
+
+// sys_page_alloc for each page of [va, va + npages pages).
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct Env *env;
+	int r;
+
+	if (!VALID_USER_RANGE(va, npages) || !VALID_USER_PERM(perm))
+		return -E_INVAL;
+
+	if (envid2env_lock(envid, &env, 1) != 0)
+		return -E_BAD_ENV;
+
+	r = page_alloc_range(env->env_pgdir, va, npages, perm);
+	env_unlock(env);
+	return r;
+}
+
+// sys_page_map for each page of [srcva, srcva + npages pages).
+// Perm is passed in the low bits of dstva, which has no room for it
+// otherwise; the user library hides this.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+		   envid_t dstenvid, uintptr_t dstva_perm, size_t npages)
+{
+	struct Env *srcenv, *dstenv;
+	void *dstva = (void *) ROUNDDOWN(dstva_perm, PGSIZE);
+	int perm = PGOFF(dstva_perm);
+	int r;
+
+	if (!VALID_USER_RANGE(srcva, npages) ||
+	    !VALID_USER_RANGE(dstva, npages) || !VALID_USER_PERM(perm))
+		return -E_INVAL;
+
+	if (envid2env_lock_pair(srcenvid, &srcenv, dstenvid, &dstenv, 1) != 0)
+		return -E_BAD_ENV;
+
+	r = page_map_range(dstenv->env_pgdir, dstva, srcenv->env_pgdir, srcva,
+			   npages, perm);
+	env_unlock_pair(srcenv, dstenv);
+	return r;
+}
+
+// sys_page_unmap for each page of [va, va + npages pages).
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	struct Env *env;
+
+	if (!VALID_USER_RANGE(va, npages))
+		return -E_INVAL;
+
+	if (envid2env_lock(envid, &env, 1) != 0)
+		return -E_BAD_ENV;
+
+	page_remove_range(env->env_pgdir, va, npages);
+	env_unlock(env);
+	return 0;
+}
+
+// Change the permissions of the pages mapped in [va, va + npages pages)
+// in the address space of 'envid' to 'perm', which has the same
+// restrictions as in sys_page_map.  Unmapped pages are skipped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the range isn't page-aligned or doesn't fit below UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but one of the pages is read-only.
+static int
+sys_page_protect_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct Env *env;
+	int r;
+
+	if (!VALID_USER_RANGE(va, npages) || !VALID_USER_PERM(perm))
+		return -E_INVAL;
+
+	if (envid2env_lock(envid, &env, 1) != 0)
+		return -E_BAD_ENV;
+
+	r = page_protect_range(env->env_pgdir, va, npages, perm);
+	env_unlock(env);
+	return r;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// srcva may also be IPC_PAGES(va, n) to send the n pages from va.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -334,7 +552,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -349,7 +568,8 @@ sys_page_unmap(envid_t envid, void *va)
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned,
+//		or names more than IPC_MAXPAGES pages.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
@@ -361,52 +581,156 @@ sys_page_unmap(envid_t envid, void *va)
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
+	struct Env *send_env;
 	struct Env *recv_env;
-	struct PageInfo *map_page;
-	pte_t *map_pte;
+	struct IpcPages pages;
+	int npages;
+	int r = 0;
+
+	if ((r = ipc_range(srcva, &srcva, &npages)) < 0)
+		return r;
 
-	if (envid2env(envid, &recv_env, 0) != 0)
+	// The rendezvous is protected by the receiver's lock; we also hold
+	// our own so that the pages we send can't be unmapped under us.
+	if (envid2env_lock_pair(0, &send_env, envid, &recv_env, 0) != 0)
 		return -E_BAD_ENV;
 
-	if (!recv_env->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
+	if (!ipc_recving_from(recv_env, send_env)) {
+		r = -E_IPC_NOT_RECV;
+		goto out;
+	}
 
-	if ((uintptr_t)srcva < UTOP &&
-	    (uintptr_t)recv_env->env_ipc_dstva < UTOP)
-	{
-		if (!ALIGNED_USER_ADDR(srcva))
-			return -E_INVAL;
-		if (!VALID_USER_PERM(perm))
-			return -E_INVAL;
+	// Only look at the pages if the receiver wants any.
+	if (recv_env->env_ipc_dstnpages == 0)
+		npages = 0;
+	if ((r = ipc_lookup_pages(send_env, srcva, npages, perm, &pages)) < 0)
+		goto out;
 
-		if ((map_page = page_lookup(curenv->env_pgdir, srcva, &map_pte))
-		    == NULL)
-			return -E_INVAL;
-		if ((perm & PTE_W) && !(*map_pte & PTE_W))
-			return -E_INVAL;
+	if ((r = ipc_deliver(recv_env, send_env->env_id, value, &pages,
+			     false)) != 0)
+		goto out;
 
-		// We don't use sys_page_map because it always sets the
-		// checkperm flag in envid2env.
-		if (page_insert(recv_env->env_pgdir, map_page,
-				recv_env->env_ipc_dstva, perm) != 0)
-			return -E_NO_MEM;
+	// Wake recv_env up; ipc_deliver has set what it returns.
+	sched_enqueue(recv_env);
+
+out:
+	env_unlock_pair(send_env, recv_env);
+	return r;
+}
 
-		recv_env->env_ipc_perm = perm;
+// Send 'value' (and the page at 'srcva', if srcva < UTOP) to 'envid',
+// blocking until envid receives it.  If 'call', then also wait for
+// envid's reply, to be received at 'dstva' like in sys_ipc_recv; we start
+// waiting for it before the request goes through, so it can't be missed.
+//
+// If envid is already waiting in sys_ipc_recv, the message goes through
+// right away and we hand envid our CPU.  Otherwise we queue up on envid's
+// wait list, and envid gets the message as soon as it asks for one.  In
+// the meantime we hold on to the page, so envid gets the page mapped at
+// 'srcva' now even if we're made to unmap it.
+static int
+ipc_send_blocking(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		  bool call, void *dstva)
+{
+	struct Env *send_env;
+	struct Env *recv_env;
+	struct IpcPages pages;
+	int npages, dstnpages = 0;
+	bool directed = false;
+	int r;
+
+	if ((r = ipc_range(srcva, &srcva, &npages)) < 0)
+		return r;
+	if (call && (r = ipc_range(dstva, &dstva, &dstnpages)) < 0)
+		return r;
+
+	if (envid2env_lock_pair(0, &send_env, envid, &recv_env, 0) != 0)
+		return -E_BAD_ENV;
+
+	// We'd wait for ourselves forever.
+	if (recv_env == send_env) {
+		r = -E_IPC_NOT_RECV;
+		goto out;
 	}
-	else
-	{
-		recv_env->env_ipc_perm = 0;
+
+	if ((r = ipc_lookup_pages(send_env, srcva, npages, perm, &pages)) < 0)
+		goto out;
+
+	if (call) {
+		send_env->env_ipc_recving = true;
+		send_env->env_ipc_recv_from = recv_env->env_id;
+		send_env->env_ipc_batch = NULL;
+		send_env->env_ipc_dstva = dstva;
+		send_env->env_ipc_dstnpages = dstnpages;
+	}
+
+	if (ipc_recving_from(recv_env, send_env)) {
+		if ((r = ipc_deliver(recv_env, send_env->env_id, value,
+				     &pages, call)) != 0) {
+			send_env->env_ipc_recving = false;
+			goto out;
+		}
+
+		// Run recv_env right away on this CPU rather than waiting
+		// for the scheduler to find it.
+		if (!(directed = sched_claim_locked(recv_env)))
+			sched_enqueue(recv_env);
+		if (!call)
+			goto out;
+	} else {
+		// The receiver isn't ready: wait in line for it.
+		ipc_wait_block(recv_env, send_env, value, &pages);
 	}
 
-	recv_env->env_ipc_recving = false;
-	recv_env->env_ipc_value = value;
-	recv_env->env_ipc_from = curenv->env_id;
+	// Don't resurrect ourselves if we were killed in the meantime.
+	if (send_env->env_status != ENV_DYING)
+		send_env->env_status = ENV_NOT_RUNNABLE;
+	if (call)
+		sched_set_priority(send_env, send_env->env_base_priority);
+	env_unlock_pair(send_env, recv_env);
+	if (directed)
+		env_run(recv_env);
+	sched_yield();
 
-	// Make recv_env return 0
-	recv_env->env_tf.tf_regs.reg_eax = 0;
-	recv_env->env_status = ENV_RUNNABLE;
+out:
+	env_unlock_pair(send_env, recv_env);
+	if (directed) {
+		// env_run puts us back on a run queue, returning 0.
+		send_env->env_tf.tf_regs.reg_eax = 0;
+		env_run(recv_env);
+	}
+	return r;
+}
 
-	return 0;
+// Send 'value' (and the page at 'srcva', if srcva < UTOP) to 'envid',
+// blocking until it receives it.
+//
+// Returns 0 on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or dies before receiving the message.
+//	-E_IPC_NOT_RECV if envid is the current environment.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, not mapped,
+//		or perm is inappropriate (see sys_ipc_try_send).
+//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//		address space.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return ipc_send_blocking(envid, value, srcva, perm, false, NULL);
+}
+
+// Send a request to 'envid' like sys_ipc_send, then wait for envid's
+// reply like sys_ipc_recv(dstva), in one system call.  Only envid can
+// reply; other senders wait until we next call sys_ipc_recv.
+//
+// Returns 0 once the reply arrives, < 0 on error.  Errors are those of
+// sys_ipc_send and sys_ipc_recv.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	return ipc_send_blocking(envid, value, srcva, perm, true, dstva);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -414,7 +738,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // mark yourself not runnable, and then give up the CPU.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// 'dstva' is the virtual address at which the sent page should be mapped,
+// or IPC_PAGES(va, n) to accept up to n pages from va.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
@@ -423,18 +748,376 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
-	if ((uintptr_t)dstva < UTOP && !((uintptr_t)dstva % PGSIZE == 0))
-		return -E_INVAL;
+	struct IpcSender sender;
+	int dstnpages;
+	int r;
+
+	if ((r = ipc_range(dstva, &dstva, &dstnpages)) < 0)
+		return r;
+
+	env_lock(curenv);
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = dstnpages;
+	curenv->env_ipc_recv_from = 0;
+	curenv->env_ipc_batch = NULL;
+
+	// If there's a message queued for us, or somebody is already blocked
+	// sending to us, take that message and return right away.  The
+	// delivery may fail if we can't map its pages, in which case we try
+	// the next one.
+	while (ipc_queue_get(curenv, &sender) ||
+	       ipc_wait_dequeue(curenv, &sender)) {
+		r = ipc_deliver(curenv, sender.envid, sender.value,
+				&sender.pages, sender.call);
+		env_unlock(curenv);
+		ipc_send_done(&sender, r);
+		if (r == 0)
+			return 0;
+		env_lock(curenv);
+	}
 
 	curenv->env_ipc_recving = true;
+
+	// Don't resurrect ourselves if we were killed in the meantime.
+	if (curenv->env_status != ENV_DYING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+
+	// Envs that block waiting for messages are servers or interactive;
+	// boost them so they run promptly once the message arrives.
+	sched_set_priority(curenv, curenv->env_base_priority);
+	env_unlock(curenv);
+	sched_yield();
+
+	return 0;
+}
+
+// Send 'value' (and the page at 'srcva', if srcva < UTOP) to 'envid'
+// without waiting for it to receive it.  If envid isn't waiting for a
+// message, the message goes on its queue, from which sys_ipc_recv and
+// sys_ipc_recv_batch take messages first, in the order they were sent.
+// The page sent is the one mapped at 'srcva' now.
+//
+// Returns 0 on success, < 0 on error.
+// Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_IPC_QUEUE_FULL if envid already has IPC_QUEUE_LEN messages
+//		waiting for it.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, not mapped,
+//		or perm is inappropriate (see sys_ipc_try_send).
+//	-E_NO_MEM if there's not enough memory to queue the message or to
+//		map srcva in envid's address space.
+static int
+sys_ipc_send_async(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *send_env;
+	struct Env *recv_env;
+	struct IpcPages pages;
+	int npages;
+	int r;
+
+	if ((r = ipc_range(srcva, &srcva, &npages)) < 0)
+		return r;
+
+	if (envid2env_lock_pair(0, &send_env, envid, &recv_env, 0) != 0)
+		return -E_BAD_ENV;
+
+	if ((r = ipc_lookup_pages(send_env, srcva, npages, perm, &pages)) < 0)
+		goto out;
+
+	if (ipc_recving_from(recv_env, send_env)) {
+		if ((r = ipc_deliver(recv_env, send_env->env_id, value,
+				     &pages, false)) == 0)
+			sched_enqueue(recv_env);
+	} else
+		r = ipc_queue_put(recv_env, send_env->env_id, value, &pages);
+
+out:
+	env_unlock_pair(send_env, recv_env);
+	return r;
+}
+
+// Receive up to 'n' messages into 'msgs', blocking until there is at
+// least one.  Messages queued by sys_ipc_send_async come first; if there
+// are none, we take one from an env blocked sending to us.  If 'dstva' is
+// < UTOP, we're willing to receive pages: the i'th message's page, if
+// any, gets mapped at dstva + i * PGSIZE.
+//
+// Returns the number of messages received, or < 0 on error.  Errors are:
+//	-E_INVAL if n <= 0, or dstva < UTOP but dstva is not page-aligned
+//		or the n pages from dstva don't fit below UTOP.
+//	-E_FAULT if msgs isn't writable.
+static int
+sys_ipc_recv_batch(struct IpcMsg *msgs, int n, void *dstva)
+{
+	struct IpcSender sender;
+	int got, r;
+
+	if (n <= 0)
+		return -E_INVAL;
+	n = MIN(n, IPC_QUEUE_LEN);
+	if ((uintptr_t)dstva < UTOP &&
+	    ((uintptr_t)dstva % PGSIZE != 0 ||
+	     (uintptr_t)dstva + n * PGSIZE > UTOP))
+		return -E_INVAL;
+
+	env_lock(curenv);
+	if ((r = user_mem_check(curenv, msgs, n * sizeof(*msgs),
+				PTE_U | PTE_W)) < 0) {
+		env_unlock(curenv);
+		return r;
+	}
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_dstnpages = (uintptr_t)dstva < UTOP ? n : 0;
+	curenv->env_ipc_recv_from = 0;
+
+	// Messages we can't deliver are dropped, as in sys_ipc_recv.
+	for (got = 0; got < n && ipc_queue_get(curenv, &sender); ) {
+		if (ipc_deliver_batch(curenv, msgs, got, sender.envid,
+				      sender.value, &sender.pages, false) == 0)
+			got++;
+		ipc_send_done(&sender, 0);
+	}
+	if (got > 0) {
+		env_unlock(curenv);
+		return got;
+	}
 
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	if (ipc_wait_dequeue(curenv, &sender)) {
+		r = ipc_deliver_batch(curenv, msgs, 0, sender.envid,
+				      sender.value, &sender.pages, sender.call);
+		env_unlock(curenv);
+		ipc_send_done(&sender, r);
+		return r == 0 ? 1 : r;
+	}
+
+	// Nothing yet: block until a message gets delivered to msgs[0].
+	curenv->env_ipc_recving = true;
+	curenv->env_ipc_batch = msgs;
+	if (curenv->env_status != ENV_DYING)
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_set_priority(curenv, curenv->env_base_priority);
+	env_unlock(curenv);
 	sched_yield();
+}
+
+// Reply to the env whose sys_ipc_call we last received, with 'value' (and
+// the page at 'srcva', if srcva < UTOP), then wait for the next message
+// like sys_ipc_recv(dstva), in one system call.  If there's nobody to
+// reply to, or the caller has stopped waiting, only the wait happens.
+// Unless another message is already waiting for us, we hand our CPU to
+// the caller.
+//
+// Return < 0 on error, without waiting.  Errors are:
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, not mapped,
+//		or perm is inappropriate (see sys_ipc_try_send).
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_NO_MEM if there's not enough memory to map srcva in the
+//		caller's address space.
+static int
+sys_ipc_reply_wait(uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *self;
+	struct Env *caller;
+	struct IpcPages pages;
+	struct IpcSender sender;
+	void *rcvva;
+	int npages, rcvnpages;
+	bool replied = false, directed = false;
+	int r;
+
+	if ((r = ipc_range(srcva, &srcva, &npages)) < 0 ||
+	    (r = ipc_range(dstva, &rcvva, &rcvnpages)) < 0)
+		return r;
+
+	// The caller may be long gone; then there's just no reply to send.
+	if (curenv->env_ipc_caller == 0 ||
+	    envid2env_lock_pair(0, &self, curenv->env_ipc_caller,
+				&caller, 0) != 0) {
+		self = curenv;
+		caller = curenv;
+		env_lock(self);
+	}
+
+	if (caller != self && ipc_recving_from(caller, self)) {
+		if ((r = ipc_lookup_pages(self, srcva, npages, perm,
+					  &pages)) < 0 ||
+		    (r = ipc_deliver(caller, self->env_id, value, &pages,
+				     false)) != 0) {
+			env_unlock_pair(self, caller);
+			return r;
+		}
+		replied = true;
+	}
+	self->env_ipc_caller = 0;
+	self->env_ipc_dstva = rcvva;
+	self->env_ipc_dstnpages = rcvnpages;
+	self->env_ipc_recv_from = 0;
+	self->env_ipc_batch = NULL;
+
+	// A message is already waiting for us: take it, and leave the caller
+	// to the scheduler.
+	if (ipc_queue_get(self, &sender) || ipc_wait_dequeue(self, &sender)) {
+		r = ipc_deliver(self, sender.envid, sender.value,
+				&sender.pages, sender.call);
+		if (replied)
+			sched_enqueue(caller);
+		env_unlock_pair(self, caller);
+		ipc_send_done(&sender, r);
+		// If we couldn't take that one, wait for the next one.
+		return r == 0 ? 0 : sys_ipc_recv(dstva);
+	}
+
+	self->env_ipc_recving = true;
+	if (self->env_status != ENV_DYING)
+		self->env_status = ENV_NOT_RUNNABLE;
+	sched_set_priority(self, self->env_base_priority);
+	if (replied && !(directed = sched_claim_locked(caller)))
+		sched_enqueue(caller);
+	env_unlock_pair(self, caller);
+
+	if (directed)
+		env_run(caller);
+	sched_yield();
+}
+
+// Set envid's base priority to 'priority', which must be between 0 (the
+// highest) and ENV_NPRIO - 1.  The env also moves to that priority right
+// away; from there, it's demoted as it uses up time slices and boosted
+// back when it blocks to receive IPC.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is out of range.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *env;
+	int r;
+
+	if (priority < 0 || priority >= ENV_NPRIO)
+		return -E_INVAL;
+
+	if ((r = envid2env_lock(envid, &env, 1)) < 0)
+		return r;
+
+	env->env_base_priority = priority;
+	sched_set_priority(env, priority);
+	env_unlock(env);
 
 	return 0;
 }
 
+// Let idle CPUs merge envid's read-only and copy-on-write pages with
+// identical pages of other envs that allow it (on != 0), or stop them.
+// Children created later inherit the setting.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_mergeable(envid_t envid, int on)
+{
+	struct Env *env;
+	int r;
+
+	if ((r = envid2env_lock(envid, &env, 1)) < 0)
+		return r;
+	env->env_merge = on != 0;
+	env_unlock(env);
+	return 0;
+}
+
+// Can sys_submit run system call 'num'?  Not if it may block or switch
+// to another env, nor if it would need to return twice.
+static bool
+submit_allowed(uint32_t num)
+{
+	switch (num) {
+	case SYS_cputs:
+	case SYS_cgetc:
+	case SYS_getenvid:
+	case SYS_env_destroy:
+	case SYS_page_alloc:
+	case SYS_page_map:
+	case SYS_page_unmap:
+	case SYS_page_alloc_range:
+	case SYS_page_map_range:
+	case SYS_page_unmap_range:
+	case SYS_page_protect_range:
+	case SYS_env_set_status:
+	case SYS_env_set_trapframe:
+	case SYS_env_set_pgfault_upcall:
+	case SYS_env_set_priority:
+	case SYS_env_set_mergeable:
+	case SYS_ipc_send_async:
+	case SYS_get_cpu:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Run the system calls queued in 'ring', from its sr_head up to its
+// sr_tail, in order, storing each one's return value in its sd_ret and
+// moving sr_head past it.  With SUBMIT_STOP in 'flags', stop after the
+// first one that fails.  Calls that may block, like sys_yield and the
+// blocking IPC calls, fail with -E_INVAL without being run.
+//
+// Each call may change our address space, so the ring is checked and
+// copied in and out under our lock, one call at a time.
+//
+// Returns the number of calls run, or < 0 on error.  Errors are:
+//	-E_INVAL if ring isn't writable memory, or holds more than
+//		SYSRING_NENTS calls.
+static int
+sys_submit(struct SyscallRing *ring, int flags)
+{
+	struct SyscallDesc d;
+	uint32_t head;
+	int n;
+
+	for (n = 0; ; n++) {
+		env_lock(curenv);
+		if (user_mem_check(curenv, ring, sizeof(*ring),
+				   PTE_U | PTE_W) < 0) {
+			env_unlock(curenv);
+			return -E_INVAL;
+		}
+		head = ring->sr_head;
+		if (ring->sr_tail - head > SYSRING_NENTS) {
+			env_unlock(curenv);
+			return -E_INVAL;
+		}
+		if (head == ring->sr_tail) {
+			env_unlock(curenv);
+			return n;
+		}
+		d = ring->sr_ents[head % SYSRING_NENTS];
+		env_unlock(curenv);
+
+		if (submit_allowed(d.sd_num))
+			d.sd_ret = syscall(d.sd_num, d.sd_args[0], d.sd_args[1],
+					   d.sd_args[2], d.sd_args[3],
+					   d.sd_args[4]);
+		else
+			d.sd_ret = -E_INVAL;
+
+		env_lock(curenv);
+		if (user_mem_check(curenv, ring, sizeof(*ring),
+				   PTE_U | PTE_W) < 0) {
+			env_unlock(curenv);
+			return -E_INVAL;
+		}
+		ring->sr_ents[head % SYSRING_NENTS].sd_ret = d.sd_ret;
+		ring->sr_head = head + 1;
+		env_unlock(curenv);
+
+		if ((flags & SUBMIT_STOP) && d.sd_ret < 0)
+			return n + 1;
+	}
+}
+
 static int
 sys_get_cpu(void)
 {
@@ -467,8 +1150,24 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 					      (int) a5);
 	case SYS_page_unmap:
 		return (int32_t) sys_page_unmap((envid_t) a1, (void *) a2);
+	case SYS_page_alloc_range:
+		return (int32_t) sys_page_alloc_range((envid_t) a1, (void *) a2,
+						      (size_t) a3, (int) a4);
+	case SYS_page_map_range:
+		return (int32_t) sys_page_map_range((envid_t) a1, (void *) a2,
+						    (envid_t) a3, a4,
+						    (size_t) a5);
+	case SYS_page_unmap_range:
+		return (int32_t) sys_page_unmap_range((envid_t) a1, (void *) a2,
+						      (size_t) a3);
+	case SYS_page_protect_range:
+		return (int32_t) sys_page_protect_range((envid_t) a1,
+							(void *) a2,
+							(size_t) a3, (int) a4);
 	case SYS_exofork:
 		return (int32_t) sys_exofork();
+	case SYS_fork:
+		return (int32_t) sys_fork();
 	case SYS_env_set_status:
 		return (int32_t) sys_env_set_status((envid_t) a1, (int) a2);
 	case SYS_env_set_pgfault_upcall:
@@ -481,6 +1180,21 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_ipc_try_send:
 		return (int32_t) sys_ipc_try_send((envid_t) a1, a2, (void *) a3,
 						  (unsigned) a4);
+	case SYS_ipc_send:
+		return (int32_t) sys_ipc_send((envid_t) a1, a2, (void *) a3,
+					      (unsigned) a4);
+	case SYS_ipc_call:
+		return (int32_t) sys_ipc_call((envid_t) a1, a2, (void *) a3,
+					      (unsigned) a4, (void *) a5);
+	case SYS_ipc_reply_wait:
+		return (int32_t) sys_ipc_reply_wait(a1, (void *) a2,
+						    (unsigned) a3, (void *) a4);
+	case SYS_ipc_send_async:
+		return (int32_t) sys_ipc_send_async((envid_t) a1, a2,
+						    (void *) a3, (unsigned) a4);
+	case SYS_ipc_recv_batch:
+		return (int32_t) sys_ipc_recv_batch((struct IpcMsg *) a1,
+						    (int) a2, (void *) a3);
 	case SYS_ipc_recv:
 		return (int32_t) sys_ipc_recv((void *) a1);
 	case SYS_get_cpu:
@@ -488,6 +1202,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_env_set_trapframe:
 		return (int32_t) sys_env_set_trapframe((envid_t) a1,
 						       (struct Trapframe *) a2);
+	case SYS_env_set_priority:
+		return (int32_t) sys_env_set_priority((envid_t) a1, (int) a2);
+	case SYS_env_set_mergeable:
+		return (int32_t) sys_env_set_mergeable((envid_t) a1, (int) a2);
+	case SYS_submit:
+		return (int32_t) sys_submit((struct SyscallRing *) a1, (int) a2);
 	default:
 		return -E_INVAL;
 	}
@@ -0,0 +1,81 @@
+// The system information page.
+//
+// One page, mapped read-only at UINFO in every address space (it lives in
+// the page table kern_pgdir shares with them all), that tells user
+// programs the time, which env each CPU runs, and a few counters, without
+// a system call.  Each CPU writes which env it runs when it enters or
+// leaves user mode, and counts its ticks and switches.  Run queue lengths
+// are written as the queues change.  The free page count, which takes
+// page_lock to add up, is refreshed at most about once a millisecond,
+// whenever some CPU enters the kernel from user mode or goes idle.  Timer
+// ticks can't be relied on for that: a CPU with a single env to run, or
+// none, gets none.
+//
+// The clock is the TSC, measured against the 8253 timer at boot.  We take
+// the TSCs of all CPUs to run at the same rate and to have started
+// together, which holds on anything with an invariant TSC.
+
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/pmap.h>
+#include <kern/kclock.h>
+#include <kern/sysinfo.h>
+
+// How often si_free_pages is refreshed, in TSC ticks, and when next.
+// If we don't know how fast the TSC runs, take it to be 1GHz.
+static uint64_t sysinfo_free_cycles = 1000000;
+static uint64_t sysinfo_free_next;
+
+struct SysInfo *sysinfo;
+
+//
+// Allocate the system information page, map it at UINFO, and start the
+// clock.  Called once, after mp_init, before any env is created.
+//
+void
+sysinfo_init(void)
+{
+	struct PageInfo *pp;
+	uint64_t hz;
+
+	static_assert(sizeof(struct SysInfo) <= PGSIZE);
+	static_assert(NCPU <= SYSINFO_NCPU);
+
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		panic("sysinfo_init: out of memory");
+	if (page_insert(kern_pgdir, pp, (void *) UINFO, PTE_U) < 0)
+		panic("sysinfo_init: out of memory");
+	sysinfo = page2kva(pp);
+
+	sysinfo->si_ncpu = ncpu;
+	sysinfo->si_free_pages = num_free_pages();
+
+	// si_ns_mult has to fit in 32 bits.
+	hz = tsc_calibrate();
+	if (hz > 1000000000 >> (32 - SYSINFO_NS_SHIFT)) {
+		sysinfo->si_tsc_hz = hz;
+		sysinfo->si_ns_mult = (1000000000ULL << SYSINFO_NS_SHIFT) / hz;
+		sysinfo_free_cycles = hz / 1000;
+		cprintf("TSC runs at %u kHz\n", (uint32_t) (hz / 1000));
+	} else
+		cprintf("TSC calibration failed; no clock\n");
+	sysinfo->si_tsc_boot = read_tsc();
+}
+
+//
+// Called on every entry to the kernel from user mode, and before halting,
+// with no locks held: refresh
+// si_free_pages if it's been a while.  CPUs racing through here at once
+// may both refresh it, which does no harm.
+//
+void
+sysinfo_refresh(void)
+{
+	uint64_t now;
+
+	if (sysinfo == NULL || (now = read_tsc()) < sysinfo_free_next)
+		return;
+	sysinfo_free_next = now + sysinfo_free_cycles;
+	sysinfo->si_free_pages = num_free_pages();
+}
@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SYSINFO_H
+#define JOS_KERN_SYSINFO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/sysinfo.h>
+#include <kern/cpu.h>
+
+// The kernel's writable view of the page at UINFO.
+extern struct SysInfo *sysinfo;
+
+// This CPU's entry in it.
+#define thissysinfo	(&sysinfo->si_cpus[cpunum()])
+
+void	sysinfo_init(void);
+void	sysinfo_refresh(void);
+
+#endif	// !JOS_KERN_SYSINFO_H
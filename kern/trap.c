@@ -13,6 +13,9 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/cpuid.h>
+#include <kern/fpu.h>
+#include <kern/sysinfo.h>
 
 static struct Taskstate ts;
 
@@ -60,6 +63,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_IPI_WAKEUP)
+		return "Wake-up IPI";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -113,6 +118,8 @@ trap_init(void)
 	SETGATE(idt[47], 0, GD_KT, trapentries[47], 0);
 	/* SYSCALLs */
 	SETGATE(idt[48], 0, GD_KT, trapentries[48], 3);
+	/* Cross-CPU wake-ups */
+	SETGATE(idt[49], 0, GD_KT, trapentries[49], 0);
 
 	// Per-CPU setup
 	trap_init_percpu();
@@ -162,6 +169,19 @@ trap_init_percpu(void)
 	// bottom three bits are special; we leave them 0)
 	ltr(GD_TSS0 + (cpunum() << 3));
 
+	// sysenter lands on the same stack.  sysexit takes its segments
+	// from the GDT entries that follow GD_KT: GD_KD, GD_UT and GD_UD.
+	if (cpu_hasedxfeat(CPUID_FEAT_EDX_SEP)) {
+		extern void sysenter_handler(void);
+
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, KSTACKTOPCPU(cpunum()));
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
+
+	// Trap the first FPU instruction of each env.
+	fpu_init_percpu();
+
 	// Load the IDT
 	lidt(&idt_pd);
 }
@@ -228,6 +248,11 @@ trap_dispatch(struct Trapframe *tf)
 	case T_DEBUG:
 		monitor(tf);
 		return;
+	case T_DEVICE:
+		// First FPU instruction since we switched to curenv.
+		if ((tf->tf_cs & 3) == 3 && fpu_trap() == 0)
+			return;
+		break;
 	case T_SYSCALL:
 		tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
 					      tf->tf_regs.reg_edx,
@@ -251,6 +276,13 @@ trap_dispatch(struct Trapframe *tf)
 	// interrupt using lapic_eoi() before calling the scheduler!
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		lapic_eoi();
+		sched_tick();
+		return;
+	}
+
+	// Another CPU queued work while we were halted; go steal it.
+	if (tf->tf_trapno == T_IPI_WAKEUP) {
 		lapic_eoi();
 		sched_yield();
 	}
@@ -272,6 +304,7 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_cs == GD_KT)
 		panic("unhandled trap in kernel");
 	else {
+		env_lock(curenv);
 		env_destroy(curenv);
 		return;
 	}
@@ -289,10 +322,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We're awake again if we were halted in sched_halt()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -300,20 +331,14 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// We don't acquire if already in kernel mode because it means
-		// we're already holding it!
 		// LAB 4: Your code here.
 		assert(curenv);
-		lock_kernel();
+		sysinfo_refresh();
 
-		// Garbage collect if current environment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+		// Garbage collect if current environment is a zombie;
+		// sched_yield() frees it as it lets go of it.
+		if (curenv->env_status == ENV_DYING)
 			sched_yield();
-		}
 
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
@@ -340,6 +365,76 @@ trap(struct Trapframe *tf)
 }
 
 
+// System calls made with sysenter come here from sysenter_handler in
+// kern/trapentry.S, with the user's registers in *regs.  The user stub in
+// lib/syscall.c passes the system call number and arguments as for
+// int $T_SYSCALL, its stack pointer in %ebp and the address to return to
+// on top of its stack, and expects %edx and %ecx to be clobbered.
+// 'eflags' are the user's flags, as they were at sysenter.
+//
+// Instead of copying a whole trap frame, we fill in curenv->env_tf with
+// what it takes to resume the environment with iret: if the system call
+// blocks or switches environments, we never come back here, and env_run
+// resumes it as it would after int $T_SYSCALL.  Otherwise we return to
+// sysenter_handler, which goes back to user mode with sysexit.
+void
+sysenter_trap(struct PushRegs *regs, uint32_t eflags)
+{
+	struct Trapframe *tf;
+	uintptr_t esp = regs->reg_ebp;
+	uintptr_t eip;
+
+	// Halt the CPU if some other CPU has called panic()
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+	sysinfo_refresh();
+
+	assert(curenv);
+	if (curenv->env_status == ENV_DYING)
+		sched_yield();
+
+	env_lock(curenv);
+	user_mem_assert(curenv, (void *) esp, sizeof(uint32_t), 0);
+	eip = *(uint32_t *) esp;
+	env_unlock(curenv);
+
+	tf = &curenv->env_tf;
+	tf->tf_regs = *regs;
+	tf->tf_es = GD_UD | 3;
+	tf->tf_ds = GD_UD | 3;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_err = 0;
+	tf->tf_eip = eip;
+	tf->tf_cs = GD_UT | 3;
+	tf->tf_eflags = eflags | FL_IF;
+	tf->tf_esp = esp;
+	tf->tf_ss = GD_UD | 3;
+	last_tf = tf;
+
+	tf->tf_regs.reg_eax = syscall(regs->reg_eax, regs->reg_edx,
+				      regs->reg_ecx, regs->reg_ebx,
+				      regs->reg_edi, regs->reg_esi);
+
+	// Take the long way back if the system call changed where we
+	// resume, or we may not go on.  So do single-stepped envs, and envs
+	// with NT set: sysenter_handler can't restore those flags safely,
+	// but iret can.
+	if (curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	if (tf->tf_eip != eip || tf->tf_esp != esp ||
+	    (tf->tf_eflags & (FL_TF | FL_NT)))
+		env_run(curenv);
+
+	// What env_run would do for the same env.
+	curenv->env_runs++;
+	pgdir_load(curenv->env_pgdir);
+
+	regs->reg_eax = tf->tf_regs.reg_eax;
+	regs->reg_edx = eip;
+	regs->reg_ecx = esp;
+}
+
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -392,6 +487,19 @@ page_fault_handler(struct Trapframe *tf)
 	// 1. We check if the environment has a page fault handler, and if it
 	// has allocated a page for its exception stack.
 
+	// Hold our own lock while we write to the exception stack, so that
+	// our parent can't unmap it in the meantime.
+	env_lock(curenv);
+
+	// Writes to copy-on-write pages are resolved here, without bothering
+	// the environment.  If we're out of memory, it gets the fault.
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR) &&
+	    fault_va < UTOP &&
+	    page_cow(curenv->env_pgdir, (void *) fault_va) == 0) {
+		env_unlock(curenv);
+		return;
+	}
+
 	if (curenv->env_pgfault_upcall != NULL)
 	{
 		uintptr_t traptime_esp = tf->tf_esp;
@@ -424,6 +532,7 @@ page_fault_handler(struct Trapframe *tf)
 			// Make the environment execute its pgfault handler
 			tf->tf_eip = (uintptr_t) curenv->env_pgfault_upcall;
 
+			env_unlock(curenv);
 			return;
 		}
 	}
@@ -4,28 +4,50 @@
 
 #define debug 0
 
+// Where the pages of requests and replies too big for fsipcbuf go: a
+// request page followed by up to FSIPC_MAXDATA bytes of data, just below
+// the fd table.
+#define FSIPC_WINDOW	(0xD0000000 - IPC_MAXPAGES * PGSIZE)
+#define FSIPC_DATA	(FSIPC_WINDOW + PGSIZE)
+
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// Send the request in the 'npages' pages at 'srcva' to the file server,
+// and wait for a reply.
 // type: request code, passed as the simple integer IPC value.
-// dstva: virtual address at which to receive reply page, 0 if none.
+// dstva: virtual address at which to receive reply pages (which may be
+// an IPC_PAGES range), 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_pages(unsigned type, void *srcva, int npages, void *dstva)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)srcva);
+
+	return ipc_call(fsenv, type, IPC_PAGES(srcva, npages),
+			PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+// Send an inter-environment request to the file server, and wait for
+// a reply.  The request body should be in fsipcbuf, and parts of the
+// response may be written back to fsipcbuf.
+static int
+fsipc(unsigned type, void *dstva)
+{
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+	return fsipc_pages(type, &fsipcbuf, 1, dstva);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Unmap the pages holding the first n bytes of FSIPC_DATA.
+static void
+fsipc_data_unmap(size_t n)
+{
+	sys_page_unmap_range(0, (void *) FSIPC_DATA, ROUNDUP(n, PGSIZE) / PGSIZE);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -115,15 +137,26 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
+	// Reads of more than a page come back as pages mapped at FSIPC_DATA.
 	int r;
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if (n <= PGSIZE) {
+		if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, fsipcbuf.readRet.ret_buf, r);
+		return r;
+	}
+
+	n = MIN(n, FSIPC_MAXDATA);
+	if ((r = fsipc(FSREQ_READ, IPC_PAGES(FSIPC_DATA,
+					     ROUNDUP(n, PGSIZE) / PGSIZE))) < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	memmove(buf, (void *) FSIPC_DATA, r);
+	fsipc_data_unmap(r);
 	return r;
 }
 
@@ -143,11 +176,34 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 	// LAB 5: Your code here
-	req->req_fileid = fd->fd_file.id;
-	req->req_n = MIN(n, sizeof(req->req_buf));
-	memmove(req->req_buf, buf, req->req_n);
+	// Bigger writes send the request from FSIPC_WINDOW, with the data
+	// in the pages after it.
+	size_t off;
+	int r;
+
+	if (n <= sizeof(req->req_buf)) {
+		req->req_fileid = fd->fd_file.id;
+		req->req_n = n;
+		memmove(req->req_buf, buf, n);
+		return fsipc(FSREQ_WRITE, NULL);
+	}
 
-	return fsipc(FSREQ_WRITE, NULL);
+	n = MIN(n, FSIPC_MAXDATA);
+	for (off = 0; off < PGSIZE + n; off += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) (FSIPC_WINDOW + off),
+					PTE_P | PTE_W | PTE_U)) < 0)
+			goto out;
+	req = (struct Fsreq_write *) FSIPC_WINDOW;
+	req->req_fileid = fd->fd_file.id;
+	req->req_n = n;
+	memmove((void *) FSIPC_DATA, buf, n);
+
+	r = fsipc_pages(FSREQ_WRITE, req, 1 + ROUNDUP(n, PGSIZE) / PGSIZE,
+			NULL);
+out:
+	sys_page_unmap(0, (void *) FSIPC_WINDOW);
+	fsipc_data_unmap(n);
+	return r;
 }
 
 static int
@@ -2,6 +2,28 @@
 
 #include <inc/lib.h>
 
+// Finish receiving a message; 'err' is what the receiving system call
+// returned.  See ipc_recv.
+static int32_t
+ipc_received(int err, envid_t *from_env_store, int *perm_store)
+{
+	if (err != 0)
+	{
+		if (from_env_store != NULL)
+			*from_env_store = 0;
+		if (perm_store != NULL)
+			*perm_store = 0;
+		return err;
+	}
+
+	if (from_env_store != NULL)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = thisenv->env_ipc_perm;
+
+	return thisenv->env_ipc_value;
+}
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -22,37 +44,49 @@
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 {
-	int err;
+	if (pg == NULL)
+		pg = (void *) UTOP;
 
+	return ipc_received(sys_ipc_recv(pg), from_env_store, perm_store);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env', and
+// wait for its reply, in a single system call.  The reply is received as
+// by ipc_recv(NULL, rcv_pg, perm_store): returns the value replied, or the
+// error if the system call fails.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
 	if (pg == NULL)
 		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
 
-	err = sys_ipc_recv(pg);
-	if (err != 0)
-	{
-		if (from_env_store != NULL)
-			*from_env_store = 0;
-		if (perm_store != NULL)
-			*perm_store = 0;
-		return err;
-	}
+	return ipc_received(sys_ipc_call(to_env, val, pg, perm, rcv_pg),
+			    NULL, perm_store);
+}
 
-	if (from_env_store != NULL)
-		*from_env_store = thisenv->env_ipc_from;
-	if (perm_store != NULL)
-		*perm_store = thisenv->env_ipc_perm;
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to the last env
+// that sent us a request with ipc_call, if any, then wait for the next
+// message, in a single system call.  The message is received as by
+// ipc_recv(from_env_store, rcv_pg, perm_store).
+int32_t
+ipc_reply_wait(uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
 
-	return thisenv->env_ipc_value;
+	return ipc_received(sys_ipc_reply_wait(val, pg, perm, rcv_pg),
+			    from_env_store, perm_store);
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// The kernel blocks us until 'toenv' receives it.
+// Panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
@@ -61,14 +95,48 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if (pg == NULL)
 		pg = (void *)UTOP;
 
-	while(true) {
-		err = sys_ipc_try_send(to_env, val, pg, perm);
-		if (err == 0)
-			return;
-		if (err != -E_IPC_NOT_RECV)
-			panic("sys_ipc_try_send returned err: %e", err);
-		sys_yield();
-	}
+	err = sys_ipc_send(to_env, val, pg, perm);
+	if (err != 0)
+		panic("sys_ipc_send returned err: %e", err);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// without waiting for it to be received; it's queued for 'to_env' instead.
+// If 'to_env' already has IPC_QUEUE_LEN messages queued, falls back to
+// blocking until it receives this one.
+// Panics on any error.
+void
+ipc_send_async(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	int err;
+
+	if (pg == NULL)
+		pg = (void *)UTOP;
+
+	err = sys_ipc_send_async(to_env, val, pg, perm);
+	if (err == -E_IPC_QUEUE_FULL)
+		err = sys_ipc_send(to_env, val, pg, perm);
+	if (err != 0)
+		panic("sys_ipc_send_async returned err: %e", err);
+}
+
+// Receive up to 'n' messages into 'msgs', waiting until there is at least
+// one, and return how many we got.
+// If 'pg' is nonnull, then the i'th message's page, if it comes with one,
+// is mapped at pg + i * PGSIZE, and msgs[i].im_perm is nonzero.
+// Returns < 0 if the system call fails.
+int
+ipc_recv_batch(struct IpcMsg *msgs, int n, void *pg)
+{
+	if (pg == NULL)
+		pg = (void *) UTOP;
+
+	// The kernel writes msgs directly, so make sure it isn't still
+	// copy-on-write.
+	if (n > 0)
+		memset(msgs, 0, n * sizeof(*msgs));
+
+	return sys_ipc_recv_batch(msgs, n, pg);
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -78,8 +146,9 @@ envid_t
 ipc_find_env(enum EnvType type)
 {
 	int i;
-	for (i = 0; i < NENV; i++)
+	for (i = 0; envx_mapped(i); i++) {
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
+	}
 	return 0;
 }
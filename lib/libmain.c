@@ -2,6 +2,7 @@
 // entry.S already took care of defining envs, pages, uvpd, and uvpt.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 extern void umain(int argc, char **argv);
 
@@ -11,10 +12,17 @@ const char *binaryname = "<unknown>";
 void
 libmain(int argc, char **argv)
 {
+	uint32_t edx;
+
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
 	thisenv = (struct Env *)envs + ENVX(sys_getenvid());
 
+	// The kernel sets up sysenter whenever the CPU has it (CPUID.1:EDX
+	// bit 11).
+	cpuid(1, NULL, NULL, NULL, &edx);
+	syscall_sysenter = (edx & (1 << 11)) != 0;
+
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
@@ -27,6 +27,7 @@ static const char * const error_string[MAXERROR] =
 	[E_NO_FREE_ENV]	= "out of environments",
 	[E_FAULT]	= "segmentation fault",
 	[E_IPC_NOT_RECV]= "env is not recving",
+	[E_IPC_QUEUE_FULL]= "env's IPC message queue is full",
 	[E_EOF]		= "unexpected end of file",
 	[E_NO_DISK]	= "no free space on disk",
 	[E_MAX_OPEN]	= "too many files are open",
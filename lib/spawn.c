@@ -4,12 +4,16 @@
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
+// Pages we may map at UTEMP at once, short of PFTEMP
+#define UTEMP_NPAGES		((PFTEMP - UTEMP) / PGSIZE)
 
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static int queue_call(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		      uint32_t a4, uint32_t a5);
 
 // Spawn a child process from a program image loaded from the file system.
 // prog: the pathname of the program to run.
@@ -104,6 +108,10 @@ spawn(const char *prog, const char **argv)
 	child = r;
 
 	// Set up trap frame, including initial stack.
+	if (!envx_mapped(ENVX(child))) {
+		r = -E_BAD_ENV;
+		goto error;
+	}
 	child_tf = envs[ENVX(child)].env_tf;
 	child_tf.tf_eip = elf->e_entry;
 
@@ -125,16 +133,18 @@ spawn(const char *prog, const char **argv)
 	close(fd);
 	fd = -1;
 
-	// Copy shared library state.
-	if ((r = copy_shared_pages(child)) < 0)
-		panic("copy_shared_pages: %e", r);
-
+	// Copy shared library state, set up the trap frame and start the
+	// child, all in one trip to the kernel.
 	child_tf.tf_eflags |= FL_IOPL_3;   // devious: see user/faultio.c
-	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
-		panic("sys_env_set_trapframe: %e", r);
-
-	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
+	if ((r = copy_shared_pages(child)) < 0 ||
+	    (r = queue_call(SYS_env_set_trapframe, child,
+			    (uint32_t) &child_tf, 0, 0, 0)) < 0 ||
+	    (r = queue_call(SYS_env_set_status, child,
+			    ENV_RUNNABLE, 0, 0, 0)) < 0 ||
+	    (r = sysring_submit(&sysring, SUBMIT_STOP)) < 0) {
+		sys_env_destroy(child);
+		panic("spawn: setting up the child: %e", r);
+	}
 
 	return child;
 
@@ -265,7 +275,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
 	int i, r;
-	void *blk;
+	size_t n;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,28 +286,47 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
+	// Read the file part in as many pages as fit at UTEMP at a time
+	for (i = 0; i < filesz; i += n * PGSIZE) {
+		n = MIN(ROUNDUP(filesz - i, PGSIZE) / PGSIZE, UTEMP_NPAGES);
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i),
+					    n, perm)) < 0)
+			panic("spawn: sys_page_map_range data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
 	}
+
+	// The rest is blank
+	if (i < memsz &&
+	    (r = sys_page_alloc_range(child, (void*) (va + i),
+				      (ROUNDUP(memsz, PGSIZE) - i) / PGSIZE,
+				      perm)) < 0)
+		return r;
 	return 0;
 }
 
-// Copy the mappings for shared pages into the child address space.
+// Queue a system call on sysring, first running what's queued if it's
+// full.  Returns < 0 if one of those calls failed.
+static int
+queue_call(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
+	   uint32_t a5)
+{
+	int r;
+
+	while ((r = sysring_queue(&sysring, num, a1, a2, a3, a4, a5)) ==
+	       -E_NO_MEM)
+		if ((r = sysring_submit(&sysring, SUBMIT_STOP)) < 0)
+			return r;
+	return r;
+}
+
+// Queue the mappings of our shared pages into the child address space on
+// sysring, running what's queued whenever it fills up.
 static int
 copy_shared_pages(envid_t child)
 {
@@ -307,27 +336,30 @@ copy_shared_pages(envid_t child)
 	// LAB 5: Your code here.
 	for (i = 0; i <= PDX(UXSTACKTOP - PGSIZE); i++)
 	{
-		if (uvpd[i] & PTE_P)
+		// Superpages can't be shared with sys_page_map
+		if ((uvpd[i] & PTE_P) && !(uvpd[i] & PTE_PS))
 		{
-			int j;
+			int j, n, perm;
 			// global uvpt array only enabled us to access the first
 			// page table; this is a more general solution.
 			pte_t *uvpt = (pte_t *) (UVPT | (i << 12));
 
-			// Scan the 2^10 page table entries
-			for (j = 0; j < (1 << 10); j++)
+			// Scan the 2^10 page table entries, mapping each run
+			// of shared pages with the same perm in one go
+			for (j = 0; j < (1 << 10); j += n)
 			{
-				if ((uvpt[j] & PTE_SHARE) &&
-				    (uvpt[j] & PTE_P))
-				{
-					r = duppage(child, (i << 10) + j);
-					if (r < 0)
-					{
-						sys_env_destroy(child);
-						panic("duppage: %e", r);
-					}
-				}
-
+				perm = uvpt[j] & PTE_SYSCALL;
+				for (n = 1; j + n < (1 << 10) &&
+				     (uvpt[j + n] & PTE_SYSCALL) == perm; n++)
+					;
+				if (!(perm & PTE_SHARE) || !(perm & PTE_P))
+					continue;
+
+				if ((r = queue_call(SYS_page_map_range, 0,
+						(uint32_t) PGADDR(i, j, 0), child,
+						(uint32_t) PGADDR(i, j, 0) | perm,
+						n)) < 0)
+					return r;
 			}
 		}
 	}
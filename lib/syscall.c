@@ -3,6 +3,10 @@
 #include <inc/syscall.h>
 #include <inc/lib.h>
 
+// Make system calls with sysenter rather than int $T_SYSCALL.  libmain
+// turns this on if the CPU has sysenter, which the kernel then sets up.
+bool syscall_sysenter;
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
@@ -19,17 +23,36 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
-
-	asm volatile("int %1\n"
-		     : "=a" (ret)
-		     : "i" (T_SYSCALL),
-		       "a" (num),
-		       "d" (a1),
-		       "c" (a2),
-		       "b" (a3),
-		       "D" (a4),
-		       "S" (a5)
-		     : "cc", "memory");
+	//
+	// With sysenter, we also pass our stack pointer in BP and the
+	// address to come back to on top of the stack (see sysenter_trap
+	// in kern/trap.c).  The kernel comes back with sysexit, which
+	// takes them in DX and CX.
+
+	if (syscall_sysenter)
+		asm volatile("pushl %%ebp\n"
+			     "\tpushl $1f\n"
+			     "\tmovl %%esp, %%ebp\n"
+			     "\tsysenter\n"
+			     "1:\taddl $4, %%esp\n"
+			     "\tpopl %%ebp\n"
+			     : "=a" (ret), "+d" (a1), "+c" (a2)
+			     : "0" (num),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
+	else
+		asm volatile("int %1\n"
+			     : "=a" (ret)
+			     : "i" (T_SYSCALL),
+			       "a" (num),
+			       "d" (a1),
+			       "c" (a2),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -85,8 +108,46 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, npages,
+		       perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t npages, int perm)
+{
+	// Out of argument registers: perm goes in dstva's offset bits.
+	if (PGOFF(dstva) || PGOFF(perm) != perm)
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva,
+		       dstenv, (uint32_t) dstva | perm, npages);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, npages,
+		       0, 0);
+}
+
+int
+sys_page_protect_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_protect_range, 1, envid, (uint32_t) va,
+		       npages, perm, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -105,18 +166,71 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_env_set_mergeable(envid_t envid, int on)
+{
+	return syscall(SYS_env_set_mergeable, 1, envid, on, 0, 0, 0);
+}
+
+int
+sys_submit(struct SyscallRing *ring, int flags)
+{
+	return syscall(SYS_submit, 0, (uint32_t) ring, flags, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm,
+	     void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva, 0);
+}
+
+int
+sys_ipc_send_async(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send_async, 0, envid, value, (uint32_t) srcva,
+		       perm, 0);
+}
+
+int
+sys_ipc_recv_batch(struct IpcMsg *msgs, int n, void *dstva)
+{
+	return syscall(SYS_ipc_recv_batch, 0, (uint32_t) msgs, n,
+		       (uint32_t) dstva, 0, 0);
+}
+
 // Useless system call, we can check thisenv->env_cpunum instead (i.e. the
 // kernel data structure is exposed, no need for a system call).
 int
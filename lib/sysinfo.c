@@ -0,0 +1,23 @@
+// Reading the system information page that the kernel maps at UINFO.
+// None of these make a system call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Return the time, in nanoseconds since boot, or 0 if the kernel
+// couldn't calibrate the clock.
+uint64_t
+sys_time_ns(void)
+{
+	if (sysinfo.si_tsc_hz == 0)
+		return 0;
+	return sysinfo_tsc2ns(&sysinfo, read_tsc());
+}
+
+// Return the CPU we're running on.  We may be moved to another one by
+// the time the caller looks at the answer.
+int
+getcpu(void)
+{
+	return thisenv->env_cpunum;
+}
@@ -0,0 +1,53 @@
+// Batched system calls: queue them on a SyscallRing, then run them all
+// with a single sys_submit.
+
+#include <inc/lib.h>
+
+// This environment's ring.
+struct SyscallRing sysring __attribute__((aligned(PGSIZE)));
+
+//
+// Queue system call 'num', with arguments a1 to a5, on 'ring'.
+// Returns 0 on success, -E_NO_MEM if the ring is full.
+//
+int
+sysring_queue(struct SyscallRing *ring, uint32_t num, uint32_t a1,
+	      uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct SyscallDesc *d;
+
+	if (ring->sr_tail - ring->sr_head == SYSRING_NENTS)
+		return -E_NO_MEM;
+
+	d = &ring->sr_ents[ring->sr_tail % SYSRING_NENTS];
+	d->sd_num = num;
+	d->sd_args[0] = a1;
+	d->sd_args[1] = a2;
+	d->sd_args[2] = a3;
+	d->sd_args[3] = a4;
+	d->sd_args[4] = a5;
+	ring->sr_tail++;
+	return 0;
+}
+
+//
+// Run the calls queued on 'ring' with sys_submit, passing it 'flags'.
+// Calls left over after a failure with SUBMIT_STOP are dropped.
+// Returns 0 if every call that ran succeeded, otherwise the first error.
+//
+int
+sysring_submit(struct SyscallRing *ring, int flags)
+{
+	uint32_t i, head = ring->sr_head;
+	int r;
+
+	r = sys_submit(ring, flags);
+	ring->sr_tail = ring->sr_head;
+	if (r < 0)
+		return r;
+
+	for (i = head; i != ring->sr_head; i++)
+		if ((r = ring->sr_ents[i % SYSRING_NENTS].sd_ret) < 0)
+			return r;
+	return 0;
+}
@@ -7,6 +7,8 @@ wait(envid_t envid)
 	const volatile struct Env *e;
 
 	assert(envid != 0);
+	if (!envx_mapped(ENVX(envid)))
+		return;
 	e = &envs[ENVX(envid)];
 	while (e->env_id == envid && e->env_status != ENV_FREE)
 		sys_yield();
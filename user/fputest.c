@@ -0,0 +1,58 @@
+// Check that each environment keeps its own x87 and SSE registers across
+// context switches.  Two children and the parent each load different
+// values, yield a lot, and check that the values are still there.
+
+#include <inc/lib.h>
+
+#define NYIELD	100
+
+static void
+check_fpu(uint32_t seed)
+{
+	int64_t x87_in, x87_out;
+	uint32_t xmm_in[4], xmm_out[4];
+	int i;
+
+	x87_in = ((int64_t) seed << 16) | (~seed & 0xffff);
+	for (i = 0; i < 4; i++)
+		xmm_in[i] = seed * (i + 1);
+
+	asm volatile("fildll %0" : : "m" (x87_in));
+	asm volatile("movups %0, %%xmm0" : : "m" (xmm_in));
+	asm volatile("movups %0, %%xmm7" : : "m" (xmm_in));
+
+	for (i = 0; i < NYIELD; i++) {
+		sys_yield();
+		// Store st(0) and load it back, to leave the stack as it was.
+		asm volatile("fistpll %0; fildll %0" : "=m" (x87_out));
+		assert(x87_out == x87_in);
+		asm volatile("movups %%xmm0, %0" : "=m" (xmm_out));
+		assert(memcmp(xmm_out, xmm_in, sizeof(xmm_in)) == 0);
+		asm volatile("movups %%xmm7, %0" : "=m" (xmm_out));
+		assert(memcmp(xmm_out, xmm_in, sizeof(xmm_in)) == 0);
+	}
+	asm volatile("fstp %st(0)");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if ((child[i] = fork()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0) {
+			check_fpu(0x12345678 * (i + 1));
+			cprintf("[%08x] fputest child %d ok\n",
+				thisenv->env_id, i);
+			return;
+		}
+	}
+
+	check_fpu(0x9abcdef1);
+	for (i = 0; i < 2; i++)
+		wait(child[i]);
+	cprintf("fputest ok\n");
+}
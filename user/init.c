@@ -57,6 +57,11 @@ umain(int argc, char **argv)
 		panic("first opencons used fd %d", r);
 	if ((r = dup(0, 1)) < 0)
 		panic("dup: %e", r);
+	// Let the kernel merge the identical pages of the shells and
+	// whatever they run.
+	if ((r = sys_env_set_mergeable(0, 1)) < 0)
+		cprintf("init: sys_env_set_mergeable: %e\n", r);
+
 	while (1) {
 		cprintf("init: starting sh\n");
 		r = spawnl("/sh", "sh", (char*)0);
@@ -4,7 +4,7 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENVS is 1024, we can print 1022 primes before running out.
+// Since NENV is 8192, we can print 8190 primes before running out.
 // The remaining two environments are the integer generator at the bottom
 // of main and user/idle.
 
@@ -13,8 +13,9 @@
 unsigned
 primeproc(void)
 {
-	int i, id, p;
+	int i, n, id, p;
 	envid_t envid;
+	struct IpcMsg msgs[IPC_QUEUE_LEN];
 
 	// fetch a prime from our left neighbor
 top:
@@ -27,11 +28,13 @@ top:
 	if (id == 0)
 		goto top;
 
-	// filter out multiples of our prime
+	// filter out multiples of our prime, a batch at a time
 	while (1) {
-		i = ipc_recv(&envid, 0, 0);
-		if (i % p)
-			ipc_send(id, i, 0, 0);
+		if ((n = ipc_recv_batch(msgs, ARRAY_SIZE(msgs), 0)) < 0)
+			panic("ipc_recv_batch: %e", n);
+		for (i = 0; i < n; i++)
+			if (msgs[i].im_value % p)
+				ipc_send_async(id, msgs[i].im_value, 0, 0);
 	}
 }
 
@@ -48,6 +51,6 @@ umain(int argc, char **argv)
 
 	// feed all the integers through
 	for (i = 2; ; i++)
-		ipc_send(id, i, 0, 0);
+		ipc_send_async(id, i, 0, 0);
 }
 
@@ -0,0 +1,47 @@
+// Time a cheap system call made with int $T_SYSCALL and with sysenter,
+// and reading the clock from the system information page instead.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+static uint64_t
+cycles_per_call(bool fast)
+{
+	uint64_t start;
+	int i;
+
+	syscall_sysenter = fast;
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	return (read_tsc() - start) / NCALLS;
+}
+
+static uint64_t
+cycles_per_time_ns(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_time_ns();
+	return (read_tsc() - start) / NCALLS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	bool avail = syscall_sysenter;
+
+	cprintf("sys_time_ns: %llu cycles per call\n", cycles_per_time_ns());
+	cprintf("int $T_SYSCALL: %llu cycles per call\n",
+		cycles_per_call(false));
+	if (!avail) {
+		cprintf("sysenter: not supported by this CPU\n");
+		return;
+	}
+	cprintf("sysenter: %llu cycles per call\n", cycles_per_call(true));
+}